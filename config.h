@@ -30,10 +30,55 @@ unsigned int tripleclicktimeout = 600;
 // This allows fullscreen editors etc to restore the screen contents on exit.
 int allowaltscreen = 1;
 
+// Frames are spaced by whole refreshes of the window's monitor, as read with
+// RandR, or of an xfps display without it. These are upper limits:
 // Maximum redraw rate for events triggered by the UI (keystrokes, mouse).
 unsigned int xfps = 120;
 // Maximum redraw rate for events triggered by the terminal (program output).
 unsigned int actionfps = 30;
+// Maximum redraw rate while the window isn't focused.
+unsigned int unfocusedfps = 10;
+// UI events keep the redraw rate at xfps for this many ms.
+unsigned int interactivetimeout = 250;
+
+// Bytes of program output buffered ahead of the parser, rounded up to a power
+// of two. The program only blocks on output once this much is unparsed.
+static unsigned int ringsize = 1 << 20;
+// Time spent parsing program output before handling other events, in ms.
+unsigned int parseslice = 4;
+// Redraw rate while program output keeps arriving faster than it is parsed.
+// Parsing gets the time between frames, so lower rates mean more throughput.
+unsigned int floodfps = 30;
+// Output arriving this many ms after a keypress is drawn right away, outside
+// the frame rate, so typed characters show up without waiting for a frame.
+unsigned int echowindow = 50;
+// Frames are held at most this many ms for a program that started a
+// synchronized update (mode 2026) and didn't end it.
+static unsigned int synctimeout = 150;
+// Bytes of printer (-o) output held while the disk or pipe behind it is slow.
+// Output that doesn't fit is dropped and reported on stderr.
+static unsigned int printsize = 1 << 22;
+// OSC and DCS strings, such as OSC 52 clipboard writes, are taken up to
+// strsize bytes. Longer ones are dropped and reported on stderr.
+static unsigned int strsize = 1 << 24;
+// The session log (-L) is rotated once it grows past logsize bytes, 0 never
+// rotates. The last logkeep logs are kept as file.1, file.2 and so on.
+static unsigned int logsize = 64 << 20;
+static unsigned int logkeep = 4;
+
+// Number of font sizes kept loaded, the current one included, so zooming back
+// to a recently used size is instant. Each size holds four faces plus up to
+// 16 fallback fonts. 0 and 1 both keep only the current size.
+unsigned int fontsetcachesize = 4;
+
+// Code point ranges whose glyphs are loaded ahead of time, in every face.
+// Printable ASCII always comes first; these follow while the terminal is idle.
+Rune warmupranges[][2] = {
+    {0x2500, 0x259f}, // box drawing and block elements
+    {0xe0a0, 0xe0b3}, // powerline symbols
+    {0x3000, 0x303f}, // CJK symbols and punctuation
+    {0x3040, 0x30ff}, // hiragana and katakana
+};
 
 // Blink period in ms, for text with the blinking attribute.
 // 0 disables blinking.
@@ -0,0 +1,244 @@
+#include "event.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#if defined(__linux)
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#else
+#include <sys/select.h>
+#endif
+#include <unistd.h>
+}
+
+#include "mt.h"
+
+#define EV_MAXFDS 8
+
+/* Watched file descriptors and what was ready for them after evwait(). */
+static struct {
+  int fd;
+  int flags;
+  int ready;
+} evfds[EV_MAXFDS];
+static int nevfds;
+static int childexited;
+
+#if defined(__linux)
+static int epfd = -1, timerfd = -1, sigfd = -1;
+static struct timespec armed; /* absolute deadline timerfd is set to */
+
+static void evctl(int op, int fd, int flags) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.data.fd = fd;
+  if (flags & EV_READ)
+    ev.events |= EPOLLIN;
+  if (flags & EV_WRITE)
+    ev.events |= EPOLLOUT;
+  if (epoll_ctl(epfd, op, fd, &ev) < 0)
+    die("epoll_ctl failed: %s\n", strerror(errno));
+}
+#else
+static volatile sig_atomic_t sigchldcaught;
+static sigset_t waitmask;
+
+static void sigchld(int a) { sigchldcaught = 1; }
+#endif
+
+struct timespec tsadd(struct timespec t, long ms) {
+  t.tv_sec += ms / 1000;
+  t.tv_nsec += (ms % 1000) * 1000000;
+  if (t.tv_nsec >= 1000000000) {
+    t.tv_sec++;
+    t.tv_nsec -= 1000000000;
+  }
+  return t;
+}
+
+/*
+ * SIGCHLD stays blocked from here on and is only seen through evchild(), so
+ * child exit is handled in the loop rather than in a signal handler. This
+ * must run before any other thread is started.
+ */
+void evinit(void) {
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+#if defined(__linux)
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    die("epoll_create1 failed: %s\n", strerror(errno));
+  if ((timerfd = timerfd_create(CLOCK_MONOTONIC,
+                                TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    die("timerfd_create failed: %s\n", strerror(errno));
+  if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+    die("signalfd failed: %s\n", strerror(errno));
+  evctl(EPOLL_CTL_ADD, timerfd, EV_READ);
+  evctl(EPOLL_CTL_ADD, sigfd, EV_READ);
+#else
+  sigprocmask(SIG_BLOCK, &mask, &waitmask);
+  sigdelset(&waitmask, SIGCHLD);
+  signal(SIGCHLD, sigchld);
+#endif
+}
+
+/* Sets the interest flags for fd, 0 stops watching it. */
+void evwatch(int fd, int flags) {
+  int i;
+
+  for (i = 0; i < nevfds && evfds[i].fd != fd; i++)
+    ;
+  if (i == nevfds) {
+    if (!flags)
+      return;
+    if (nevfds == EV_MAXFDS)
+      die("too many watched fds\n");
+    nevfds++;
+#if defined(__linux)
+    evctl(EPOLL_CTL_ADD, fd, flags);
+#endif
+  } else if (!flags) {
+#if defined(__linux)
+    evctl(EPOLL_CTL_DEL, fd, 0);
+#endif
+    evfds[i] = evfds[--nevfds];
+    return;
+  } else if (evfds[i].flags != flags) {
+#if defined(__linux)
+    evctl(EPOLL_CTL_MOD, fd, flags);
+#endif
+  }
+  evfds[i].fd = fd;
+  evfds[i].flags = flags;
+  evfds[i].ready = 0;
+}
+
+/*
+ * Waits until a watched fd is ready, the child exits or the absolute
+ * CLOCK_MONOTONIC deadline passes. A NULL deadline waits indefinitely.
+ * Returns the number of ready sources, 0 on timeout.
+ */
+int evwait(const struct timespec *deadline) {
+  struct timespec now;
+  int i, n, nready = 0;
+
+  for (i = 0; i < nevfds; i++)
+    evfds[i].ready = 0;
+  childexited = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#if defined(__linux)
+  struct epoll_event events[EV_MAXFDS + 2];
+  struct itimerspec its;
+  struct signalfd_siginfo si;
+  uint64_t expirations;
+  int timeout = -1;
+
+  memset(&its, 0, sizeof(its));
+  if (deadline && TIMEDIFF((*deadline), now) <= 0) {
+    timeout = 0;
+  } else if (deadline) {
+    its.it_value = *deadline;
+  }
+  /* Only rearm the timer when the deadline moves. */
+  if (its.it_value.tv_sec != armed.tv_sec ||
+      its.it_value.tv_nsec != armed.tv_nsec) {
+    if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+      die("timerfd_settime failed: %s\n", strerror(errno));
+    armed = its.it_value;
+  }
+
+  if ((n = epoll_wait(epfd, events, LEN(events), timeout)) < 0) {
+    if (errno == EINTR)
+      return 0;
+    die("epoll_wait failed: %s\n", strerror(errno));
+  }
+  for (int j = 0; j < n; j++) {
+    if (events[j].data.fd == timerfd) {
+      if (read(timerfd, &expirations, sizeof(expirations)) > 0)
+        armed.tv_sec = armed.tv_nsec = 0;
+      continue;
+    }
+    if (events[j].data.fd == sigfd) {
+      while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+        childexited = 1;
+      nready += childexited;
+      continue;
+    }
+    for (i = 0; i < nevfds && evfds[i].fd != events[j].data.fd; i++)
+      ;
+    if (i == nevfds)
+      continue;
+    /* Errors and hangups are reported as readable so read() sees them. */
+    if (events[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      evfds[i].ready |= EV_READ;
+    if (events[j].events & EPOLLOUT)
+      evfds[i].ready |= EV_WRITE;
+    nready++;
+  }
+#else
+  struct timespec tv, *tp = NULL;
+  fd_set rfd, wfd;
+  int maxfd = -1;
+
+  FD_ZERO(&rfd);
+  FD_ZERO(&wfd);
+  for (i = 0; i < nevfds; i++) {
+    if (evfds[i].flags & EV_READ)
+      FD_SET(evfds[i].fd, &rfd);
+    if (evfds[i].flags & EV_WRITE)
+      FD_SET(evfds[i].fd, &wfd);
+    maxfd = MAX(maxfd, evfds[i].fd);
+  }
+  if (deadline) {
+    tv.tv_sec = tv.tv_nsec = 0;
+    if (TIMEDIFF((*deadline), now) > 0) {
+      tv.tv_sec = deadline->tv_sec - now.tv_sec;
+      tv.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+      if (tv.tv_nsec < 0) {
+        tv.tv_sec--;
+        tv.tv_nsec += 1000000000;
+      }
+    }
+    tp = &tv;
+  }
+
+  /* SIGCHLD is only let through while waiting. */
+  if ((n = pselect(maxfd + 1, &rfd, &wfd, NULL, tp, &waitmask)) < 0 &&
+      errno != EINTR)
+    die("select failed: %s\n", strerror(errno));
+  if (sigchldcaught) {
+    sigchldcaught = 0;
+    childexited = 1;
+    nready++;
+  }
+  for (i = 0; n > 0 && i < nevfds; i++) {
+    if (FD_ISSET(evfds[i].fd, &rfd))
+      evfds[i].ready |= EV_READ;
+    if (FD_ISSET(evfds[i].fd, &wfd))
+      evfds[i].ready |= EV_WRITE;
+    nready += !!evfds[i].ready;
+  }
+#endif
+  return nready;
+}
+
+/* Returns what fd was ready for in the last evwait(). */
+int evready(int fd) {
+  for (int i = 0; i < nevfds; i++) {
+    if (evfds[i].fd == fd)
+      return evfds[i].ready;
+  }
+  return 0;
+}
+
+/* Returns whether a SIGCHLD arrived during the last evwait(). */
+int evchild(void) { return childexited; }
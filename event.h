@@ -0,0 +1,20 @@
+#ifndef MT_EVENT_H
+#define MT_EVENT_H
+
+#include <ctime>
+
+/* Interest and readiness flags for watched file descriptors. */
+enum event_flags {
+  EV_READ = 1 << 0,
+  EV_WRITE = 1 << 1,
+};
+
+void evinit(void);
+void evwatch(int, int);
+int evwait(const struct timespec *);
+int evready(int);
+int evchild(void);
+
+struct timespec tsadd(struct timespec, long);
+
+#endif
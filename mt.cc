@@ -1,5 +1,7 @@
 #include "mt.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <cerrno>
 #include <climits>
@@ -19,10 +21,13 @@ extern "C" {
 #include <fcntl.h>
 #include <fontconfig/fontconfig.h>
 #include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -46,6 +51,7 @@ char *argv0;
 #define UTF_INVALID 0xFFFD
 #define ESC_BUF_SIZ (128 * UTF_SIZ)
 #define ESC_ARG_SIZ 16
+#define ESC_SUB_SIZ 6
 #define STR_BUF_SIZ ESC_BUF_SIZ
 #define STR_ARG_SIZ ESC_ARG_SIZ
 
@@ -90,22 +96,36 @@ enum escape_state {
 };
 
 /* CSI Escape sequence structs */
-/* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
+/* ESC '[' [[ [<priv>] <arg> [:<sub>...] [;]] <mode> [<mode>]] */
 typedef struct {
   char buf[ESC_BUF_SIZ]; /* raw string */
   int len;               /* raw string length */
   char priv;
   int arg[ESC_ARG_SIZ];
   int narg; /* nb of args */
+  int sub[ESC_ARG_SIZ][ESC_SUB_SIZ]; /* ':' sub-parameters of each arg */
+  int nsub[ESC_ARG_SIZ];             /* nb of them */
   char mode[2];
 } CSIEscape;
 
+/* Incremental base64 decoding state */
+typedef struct {
+  uint32_t acc; /* bits not written out yet */
+  int bits;     /* nb of them */
+  int state;    /* 0 in data, 1 after padding, -1 invalid */
+  int bad;      /* the char that made it invalid */
+} B64;
+
 /* STR Escape sequence structs */
 /* ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\' */
 typedef struct {
-  char type;             /* ESC type ... */
-  char buf[STR_BUF_SIZ]; /* raw string */
-  int len;               /* raw string length */
+  char type;      /* ESC type ... */
+  char *buf;      /* raw string */
+  size_t siz;     /* allocated size of buf */
+  size_t len;     /* raw string length */
+  size_t payload; /* start of the decoded OSC 52 data in buf, 0 if none */
+  B64 b64;        /* decoder for the OSC 52 data */
+  int toolong;    /* went past strsize and is dropped */
   char *args[STR_ARG_SIZ];
   int narg; /* nb of args */
 } STREscape;
@@ -137,8 +157,10 @@ static void sendbreak(const Arg *);
 /* config.h for applying patches and the configuration. */
 #include "config.h"
 
-static void execsh(void);
-static void sigchld(int);
+static char *envstr(const char *, const char *);
+static char *findprog(char *);
+static void execsh(int, int);
+static void *ttyreader(void *);
 
 static void csidump(void);
 static void csihandle(void);
@@ -149,9 +171,12 @@ static void strdump(void);
 static void strhandle(void);
 static void strparse(void);
 static void strreset(void);
+static void strput(const char *, size_t);
+static size_t tputstr(const char *, size_t);
 
 static void tprinter(const char *, size_t);
 static void tdumpsel(void);
+static size_t tencodeline(int, char *);
 static void tdumpline(int);
 static void tdump(void);
 static void tclearregion(int, int, int, int);
@@ -166,21 +191,31 @@ static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static size_t tskipscrolled(const char *, size_t);
 static void treset(void);
 static void tresize(int, int);
 static void tscrollup(int, int);
 static void tscrolldown(int, int);
-static void tsetattr(int *, int);
+static void tsetattr(const CSIEscape *);
 static void tsetchar(Rune, MTGlyph *, int, int);
+static int trect(int *, int *, int *, int *, int *);
+static void tselclearrows(int, int);
+static void tcutwide(int, int, int);
+static void tfillrect(int, int, int, int, Rune);
+static void tcopyrect(int, int, int, int, int, int);
+static void tselerase(int, int, int, int);
 static void tsetscroll(int, int);
+static void tsetmargins(int, int);
+static int tleftmargin(void);
 static void tswapscreen(void);
+static int tgetmode(int, int);
 static void tsetmode(int, int, int *, int);
 static void tfulldirt(void);
 static void techo(Rune);
 static void tcontrolcode(uchar);
 static void tdectest(char);
 static void tdefutf8(char);
-static int32_t tdefcolor(int *, int *, int);
+static int32_t tdefcolor(const CSIEscape *, int *);
 static void tdeftran(char);
 static void tstrsequence(uchar);
 
@@ -192,10 +227,85 @@ static char utf8encodebyte(Rune, size_t);
 static char *utf8strchr(char *s, Rune u);
 static size_t utf8validate(Rune *, size_t);
 
-static char *base64dec(const char *);
+static size_t base64dec(B64 *, const char *, size_t, char *);
 
 static ssize_t xwrite(int, const char *, size_t);
 
+static int logopen(void);
+static void logerror(void);
+static void logrotate(void);
+static void logcopy(const struct iovec *, size_t, size_t);
+#if defined(__linux)
+static void logsplice(size_t);
+#endif
+static ssize_t ttyreadlog(const struct iovec *, int, size_t);
+
+/*
+ * Program output read by the reader thread and not yet parsed. head only
+ * moves in the reader thread, tail only in the main thread.
+ */
+static struct {
+  char *buf;
+  size_t mask;
+  std::atomic<size_t> head;
+  std::atomic<size_t> tail;
+  std::atomic<int> idle;   /* main thread wants a wakeup for new data */
+  std::atomic<int> full;   /* reader thread waits for space */
+  std::atomic<int> hangup; /* the pty was closed */
+  int wakefd[2];           /* reader to main thread */
+  int spacefd[2];          /* main to reader thread */
+  struct {
+    std::atomic<unsigned long> reads, bytes, waits, full;
+  } stats; /* reported with -S */
+} ring;
+
+/* Bytes written that the pty or the printer hasn't taken yet. */
+typedef struct {
+  char *buf;
+  size_t off, len, cap;
+} Queue;
+
+static Queue outq;   /* ttywrite() to cmdfd */
+static Queue printq; /* tprinter() output of the current batch */
+
+/*
+ * Printer batches handed to the writer thread, which owns iofd while it runs.
+ * Everything but started is under lock.
+ */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; /* new output, or the thread went idle */
+  Queue q;
+  size_t dropped; /* bytes thrown away since the last report */
+  int busy;       /* the thread is writing a batch */
+  int err;        /* errno of the write that failed, the thread is gone */
+  int started;
+} printer = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/*
+ * Raw session log (-L), owned by the reader thread once it runs. Output is
+ * spliced from the pty into pipe, teed into copy and spliced from there into
+ * the file, so only the ring's copy is read into user space.
+ *
+ * The log is written synchronously by the reader, so a slow disk holds back
+ * pty reads, and with them the program, rather than dropping log data. The
+ * screen keeps up with whatever was read.
+ */
+static struct {
+  int fd; /* -1 when not logging */
+  int pipe[2], copy[2];
+  size_t pipesize;
+  int splice;      /* output goes through the pipes, else through the ring */
+  int splicewrite; /* the file takes splice() */
+  int regular;     /* a file that can be rotated */
+  off_t size;
+} slog = {-1};
+
+static void qpush(Queue *, const char *, size_t);
+static void *printwriter(void *);
+static void printhandoff(void);
+static void printflush(void);
+
 /* Globals */
 TermWindow win;
 Term term;
@@ -207,8 +317,10 @@ char *opt_class = NULL;
 char *opt_embed = NULL;
 char *opt_font = NULL;
 char *opt_io = NULL;
+char *opt_log = NULL;
 char *opt_name = NULL;
 char *opt_title = NULL;
+int opt_stats = 0;
 int oldbutton = 3; /* button event on startup: 3 = release */
 
 static CSIEscape csiescseq;
@@ -229,6 +341,7 @@ size_t colornamelen = LEN(colorname);
 size_t mshortcutslen = LEN(mshortcuts);
 size_t shortcutslen = LEN(shortcuts);
 size_t selmaskslen = LEN(selmasks);
+size_t warmuprangeslen = LEN(warmupranges);
 
 // Identification sequence returned in DA and DECID.
 // We claim to be a VT102, feature detection is via terminfo in practice.
@@ -249,22 +362,6 @@ ssize_t xwrite(int fd, const char *s, size_t len) {
   return aux;
 }
 
-template <typename T> T *xmalloc(size_t len) {
-  void *p = malloc(len * sizeof(T));
-
-  if (!p)
-    die("Out of memory\n");
-
-  return static_cast<T *>(p);
-}
-
-template <typename T> T *xrealloc(void *p, size_t len) {
-  if ((p = realloc(p, len * sizeof(T))) == NULL)
-    die("Out of memory\n");
-
-  return static_cast<T *>(p);
-}
-
 char *xstrdup(char *s) {
   if ((s = strdup(s)) == NULL)
     die("Out of memory\n");
@@ -345,45 +442,74 @@ size_t utf8validate(Rune *u, size_t i) {
   return i;
 }
 
-static const char base64_digits[] = {
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  62, 0,  0,  0,  63, 52, 53, 54, 55, 56, 57, 58, 59, 60,
-    61, 0,  0,  0,  -1, 0,  0,  0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10,
-    11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0,  0,  0,  0,
-    0,  0,  26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42,
-    43, 44, 45, 46, 47, 48, 49, 50, 51, 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0};
-
-char *base64dec(const char *src) {
-  size_t in_len = strlen(src);
-  char *result, *dst;
-
-  if (in_len % 4)
-    return NULL;
-  result = dst = xmalloc<char>(in_len / 4 * 3 + 1);
-  while (*src) {
-    int a = base64_digits[(unsigned char)*src++];
-    int b = base64_digits[(unsigned char)*src++];
-    int c = base64_digits[(unsigned char)*src++];
-    int d = base64_digits[(unsigned char)*src++];
-
-    *dst++ = (a << 2) | ((b & 0x30) >> 4);
-    if (c == -1)
+/*
+ * Values of base64 digits, 64 for padding, 65 for whitespace, which is
+ * skipped, and -1 for anything else.
+ */
+static const signed char base64_digits[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, 65, 65, 65, 65, 65, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    65, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, 64, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/*
+ * Decodes n base64 digits from src into dst, carrying partial groups over to
+ * the next call in d. Whole groups of four are decoded at once. dst may be
+ * src, the output never gets ahead of the input. Returns the bytes written.
+ */
+size_t base64dec(B64 *d, const char *src, size_t n, char *dst) {
+  const uchar *p = (const uchar *)src, *end = p + n;
+  char *start = dst;
+  int a, b, c, e;
+
+  if (d->state < 0)
+    return 0;
+  for (;;) {
+    while (!d->state && !d->bits && end - p >= 4) {
+      a = base64_digits[p[0]];
+      b = base64_digits[p[1]];
+      c = base64_digits[p[2]];
+      e = base64_digits[p[3]];
+      /* Padding, whitespace and invalid digits take the slow path. */
+      if ((a | b | c | e) & ~63)
+        break;
+      dst[0] = a << 2 | b >> 4;
+      dst[1] = b << 4 | c >> 2;
+      dst[2] = c << 6 | e;
+      p += 4;
+      dst += 3;
+    }
+    if (p == end)
       break;
-    *dst++ = ((b & 0x0f) << 4) | ((c & 0x3c) >> 2);
-    if (d == -1)
+    a = base64_digits[*p++];
+    if (a == 65) {
+      continue;
+    } else if (a == 64) {
+      d->state = 1;
+    } else if (a < 0 || d->state) {
+      d->state = -1;
+      d->bad = p[-1];
       break;
-    *dst++ = ((c & 0x03) << 6) | d;
+    } else {
+      d->acc = (d->acc << 6 | a) & 0xfff;
+      if ((d->bits += 6) >= 8)
+        *dst++ = d->acc >> (d->bits -= 8);
+    }
   }
-  *dst = '\0';
-  return result;
+  return dst - start;
 }
 
 void selinit(void) {
@@ -603,7 +729,52 @@ void die(const char *errstr, ...) {
   exit(1);
 }
 
-void execsh(void) {
+/* Returns a "name=value" string for the child's environment. */
+char *envstr(const char *name, const char *value) {
+  size_t len = strlen(name) + strlen(value) + 2;
+  char *str = xmalloc<char>(len);
+
+  snprintf(str, len, "%s=%s", name, value);
+  return str;
+}
+
+/*
+ * Finds prog in $PATH, as execvp() would, so the child can use execve().
+ * Only regular executable files count; directories and the like are skipped.
+ */
+char *findprog(char *prog) {
+  const char *path, *end;
+  char *candidate;
+  size_t dirlen;
+  struct stat st;
+
+  if (strchr(prog, '/'))
+    return xstrdup(prog);
+  if (!(path = getenv("PATH")))
+    path = "/bin:/usr/bin";
+
+  for (; *path; path = *end ? end + 1 : end) {
+    if (!(end = strchr(path, ':')))
+      end = path + strlen(path);
+    dirlen = end - path;
+    candidate = xmalloc<char>(dirlen + strlen(prog) + 2);
+    sprintf(candidate, "%.*s/%s", (int)dirlen, path, prog);
+    if (dirlen && stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(candidate, X_OK) == 0)
+      return candidate;
+    free(candidate);
+  }
+
+  return xstrdup(prog);
+}
+
+/*
+ * Starts the shell on the pty slave. Everything that allocates (the passwd
+ * lookup, $PATH search and environment) happens in the parent, so that the
+ * vfork() child only needs to claim the tty and exec. Unlike fork() this
+ * doesn't copy page tables, so it costs the same however large mt grows.
+ */
+void execsh(int m, int s) {
   // Read user info from passwd file.
   const struct passwd *pw;
   errno = 0;
@@ -636,34 +807,107 @@ void execsh(void) {
     prog_only_args[0] = sh;
     args = prog_only_args;
   }
-  char *prog = args[0];
+  char *prog = findprog(args[0]);
 
-  unsetenv("COLUMNS");
-  unsetenv("LINES");
-  unsetenv("TERMCAP");
-  setenv("LOGNAME", pw->pw_name, 1);
-  setenv("USER", pw->pw_name, 1);
-  setenv("SHELL", sh, 1);
-  setenv("HOME", pw->pw_dir, 1);
-  setenv("TERM", termname, 1);
-  xsetenv();
+  // Like execvp(), run files without a #! line through /bin/sh. The argv for
+  // that is built here, the child can't allocate.
+  size_t nargs = 0;
+  for (; args[nargs]; nargs++)
+    ;
+  char **shargs = xmalloc<char *>(nargs + 2);
+  static char bin_sh_path[] = "/bin/sh";
+  shargs[0] = bin_sh_path;
+  shargs[1] = prog;
+  memcpy(shargs + 2, args + 1, nargs * sizeof(*args));
+
+  // Inherit our environment, minus the variables we set or must not leak.
+  static const char *const override[] = {"COLUMNS", "LINES",  "TERMCAP",
+                                         "LOGNAME", "USER",   "SHELL",
+                                         "HOME",    "TERM",   "WINDOWID"};
+  char winid[sizeof(long) * 8 + 1];
+  size_t nenv = 0, i, j;
+  for (; environ[nenv]; nenv++)
+    ;
+  char **env = xmalloc<char *>(nenv + LEN(override) + 1);
+  for (i = j = 0; i < nenv; i++) {
+    size_t namelen = strcspn(environ[i], "=");
+    size_t k;
+    for (k = 0; k < LEN(override); k++) {
+      if (strlen(override[k]) == namelen &&
+          !strncmp(environ[i], override[k], namelen))
+        break;
+    }
+    if (k == LEN(override))
+      env[j++] = environ[i];
+  }
+  size_t inherited = j;
+  snprintf(winid, sizeof(winid), "%lu", xwinid());
+  env[j++] = envstr("LOGNAME", pw->pw_name);
+  env[j++] = envstr("USER", pw->pw_name);
+  env[j++] = envstr("SHELL", sh);
+  env[j++] = envstr("HOME", pw->pw_dir);
+  env[j++] = envstr("TERM", termname);
+  env[j++] = envstr("WINDOWID", winid);
+  env[j] = NULL;
+
+  // Keep signal handlers from running in the child while it shares our
+  // memory. The child restores the original mask right before exec, minus
+  // SIGCHLD which the event loop keeps blocked for itself.
+  sigset_t all, old, childmask;
+  sigfillset(&all);
+  sigprocmask(SIG_BLOCK, &all, &old);
+  childmask = old;
+  sigdelset(&childmask, SIGCHLD);
+
+  switch (pid = vfork()) {
+  case -1:
+    die("fork failed\n");
+    break;
+  case 0:
+    close(iofd);
+    setsid(); /* create a new process group */
+    dup2(s, 0);
+    dup2(s, 1);
+    dup2(s, 2);
+    if (ioctl(s, TIOCSCTTY, NULL) < 0) {
+      static const char msg[] = "ioctl TIOCSCTTY failed\n";
+      write(2, msg, sizeof(msg) - 1);
+      _exit(1);
+    }
+    close(s);
+    close(m);
 
-  signal(SIGCHLD, SIG_DFL);
-  signal(SIGHUP, SIG_DFL);
-  signal(SIGINT, SIG_DFL);
-  signal(SIGQUIT, SIG_DFL);
-  signal(SIGTERM, SIG_DFL);
-  signal(SIGALRM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &childmask, NULL);
 
-  execvp(prog, args);
-  _exit(1);
+    execve(prog, args, env);
+    if (errno == ENOEXEC)
+      execve(shargs[0], shargs, env);
+    _exit(1);
+  }
+
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  for (i = inherited; i < j; i++)
+    free(env[i]);
+  free(env);
+  free(shargs);
+  free(prog);
 }
 
-void sigchld(int a) {
+/*
+ * Exits once the shell is gone, with an error if it failed. Called when the
+ * event loop sees SIGCHLD or the pty hangs up; block waits for the shell.
+ */
+void ttyreap(int block) {
   int stat;
   pid_t p;
 
-  if ((p = waitpid(pid, &stat, WNOHANG)) < 0)
+  if ((p = waitpid(pid, &stat, block ? 0 : WNOHANG)) < 0)
     die("Waiting for pid %hd failed: %s\n", pid, strerror(errno));
 
   if (pid != p)
@@ -671,6 +915,7 @@ void sigchld(int a) {
 
   if (!WIFEXITED(stat) || WEXITSTATUS(stat))
     die("child finished with error '%d'\n", stat);
+  printflush();
   exit(0);
 }
 
@@ -687,126 +932,504 @@ void ttynew(void) {
     }
   }
 
+  if (opt_log && logopen() < 0)
+    die("Error opening %s:%s\n", opt_log, strerror(errno));
+
   /* seems to work fine on linux, openbsd and freebsd */
   if (openpty(&m, &s, NULL, NULL, &w) < 0)
     die("openpty failed: %s\n", strerror(errno));
 
-  switch (pid = fork()) {
-  case -1:
-    die("fork failed\n");
-    break;
-  case 0:
-    close(iofd);
-    setsid(); /* create a new process group */
-    dup2(s, 0);
-    dup2(s, 1);
-    dup2(s, 2);
-    if (ioctl(s, TIOCSCTTY, NULL) < 0)
-      die("ioctl TIOCSCTTY failed: %s\n", strerror(errno));
-    close(s);
-    close(m);
-    execsh();
-    break;
-  default:
-    close(s);
-    cmdfd = m;
-    signal(SIGCHLD, sigchld);
-    break;
+  execsh(m, s);
+  close(s);
+  /* The reader thread waits with poll() and drains until EAGAIN. */
+  if (fcntl(m, F_SETFL, fcntl(m, F_GETFL) | O_NONBLOCK) < 0)
+    die("fcntl failed: %s\n", strerror(errno));
+  cmdfd = m;
+}
+
+/*
+ * Opens the session log for appending, and the first time the pipes for
+ * splicing into it. Returns -1 if the log can't be opened.
+ */
+int logopen(void) {
+  struct stat st;
+  int i;
+
+  /* splice() refuses O_APPEND files, so seek to the end instead. */
+  if ((slog.fd = open(opt_log, O_WRONLY | O_CREAT | O_CLOEXEC, 0600)) < 0)
+    return -1;
+  slog.regular = fstat(slog.fd, &st) == 0 && S_ISREG(st.st_mode);
+  slog.size = slog.regular ? lseek(slog.fd, 0, SEEK_END) : 0;
+  if (slog.pipesize)
+    return 0;
+
+  slog.splicewrite = 1;
+#if defined(__linux)
+  /*
+   * tee() only copies what fits into copy, so both pipes get the same size
+   * and no splice asks for more.
+   */
+  if (pipe2(slog.pipe, O_CLOEXEC) < 0 || pipe2(slog.copy, O_CLOEXEC) < 0)
+    die("pipe failed: %s\n", strerror(errno));
+  slog.pipesize = ringsize;
+  for (i = 0; i < 2; i++) {
+    fcntl(i ? slog.copy[0] : slog.pipe[0], F_SETPIPE_SZ, ringsize);
+    slog.pipesize = MIN(slog.pipesize,
+                        fcntl(i ? slog.copy[0] : slog.pipe[0], F_GETPIPE_SZ));
   }
+  slog.splice = 1;
+#endif
+  return 0;
 }
 
-size_t ttyread(void) {
-  static char buf[BUFSIZ];
-  static int buflen = 0;
-  char *ptr;
-  int charsize; /* size of utf8 char in bytes */
-  Rune unicodep;
-  int ret;
+void logerror(void) {
+  fprintf(stderr, "Error writing in %s:%s\n", opt_log, strerror(errno));
+  close(slog.fd);
+  slog.fd = -1;
+}
 
-  /* append read bytes to unprocessed bytes */
-  if ((ret = read(cmdfd, buf + buflen, LEN(buf) - buflen)) < 0)
-    die("Couldn't read from shell: %s\n", strerror(errno));
+/*
+ * Moves the log to .1, older ones up to .logkeep, and starts a new one. With
+ * logkeep at 0 the log starts over instead.
+ */
+void logrotate(void) {
+  char from[PATH_MAX], to[PATH_MAX];
+  int i;
 
-  buflen += ret;
-  ptr = buf;
+  close(slog.fd);
+  for (i = logkeep; i > 0; i--) {
+    if (i > 1)
+      snprintf(from, sizeof(from), "%s.%d", opt_log, i - 1);
+    else
+      snprintf(from, sizeof(from), "%s", opt_log);
+    snprintf(to, sizeof(to), "%s.%d", opt_log, i);
+    rename(from, to);
+  }
+  if (!logkeep && truncate(opt_log, 0) < 0) {
+    fprintf(stderr, "Error truncating %s:%s\n", opt_log, strerror(errno));
+    slog.fd = -1;
+    return;
+  }
+  if (logopen() < 0)
+    logerror();
+}
 
-  for (;;) {
-    if (IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
-      /* process a complete utf8 char */
-      charsize = utf8decode(ptr, &unicodep, buflen);
-      if (charsize == 0)
-        break;
-      tputc(unicodep);
-      ptr += charsize;
-      buflen -= charsize;
+/* Appends bytes off up to len of the data read into iov to the log. */
+void logcopy(const struct iovec *iov, size_t off, size_t len) {
+  size_t n;
 
+  for (; off < len && slog.fd != -1; off += n) {
+    if (off >= iov[0].iov_len) {
+      off -= iov[0].iov_len;
+      len -= iov[0].iov_len;
+      iov++;
+    }
+    n = MIN(len, iov[0].iov_len) - off;
+    if (xwrite(slog.fd, (char *)iov[0].iov_base + off, n) < 0)
+      logerror();
+    else
+      slog.size += n;
+  }
+}
+
+#if defined(__linux)
+/* Moves len bytes from the copy pipe into the log. */
+void logsplice(size_t len) {
+  char buf[BUFSIZ];
+  ssize_t n;
+
+  while (len > 0) {
+    if (slog.splicewrite && slog.fd != -1) {
+      n = splice(slog.copy[0], NULL, slog.fd, NULL, len, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINVAL) {
+        slog.splicewrite = 0;
+        continue;
+      }
+      if (n > 0)
+        slog.size += n;
     } else {
-      if (buflen <= 0)
-        break;
-      tputc(*ptr++ & 0xFF);
-      buflen--;
+      /* Without a log, this only drains the pipe. */
+      if ((n = read(slog.copy[0], buf, MIN(len, sizeof(buf)))) > 0 &&
+          slog.fd != -1) {
+        if (xwrite(slog.fd, buf, n) < 0)
+          logerror();
+        else
+          slog.size += n;
+      }
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      logerror();
+      slog.splicewrite = 0;
+      continue;
     }
+    len -= n;
   }
-  /* keep any uncomplete utf8 char for the next call */
-  if (buflen > 0)
-    memmove(buf, ptr, buflen);
+}
+#endif
 
+/*
+ * Reads like readv() and appends what was read to the session log, rotating
+ * it past logsize.
+ */
+ssize_t ttyreadlog(const struct iovec *iov, int iovcnt, size_t len) {
+  ssize_t ret = -1, t = 0;
+
+#if defined(__linux)
+  if (slog.splice) {
+    ret = splice(cmdfd, NULL, slog.pipe[1], NULL, MIN(len, slog.pipesize),
+                 SPLICE_F_NONBLOCK);
+    /* Ttys only support splice() on newer kernels. */
+    if (ret < 0 && errno == EINVAL)
+      slog.splice = 0;
+    else if (ret <= 0)
+      return ret;
+  }
+  if (slog.splice) {
+    if ((t = tee(slog.pipe[0], slog.copy[1], ret, SPLICE_F_NONBLOCK)) < 0)
+      t = 0;
+    if ((ret = readv(slog.pipe[0], iov, iovcnt)) < 0)
+      return ret;
+    logsplice(t);
+  }
+#endif
+  if (!slog.splice && (ret = readv(cmdfd, iov, iovcnt)) <= 0)
+    return ret;
+  /* Whatever tee() didn't duplicate is written from the ring. */
+  logcopy(iov, t, ret);
+  if (slog.fd != -1 && slog.regular && logsize && slog.size >= logsize)
+    logrotate();
   return ret;
 }
 
-void ttywrite(const char *s, size_t n) {
-  fd_set wfd, rfd;
-  ssize_t r;
-  size_t lim = 256;
+/*
+ * Starts the thread that drains the pty into the ring and returns a fd that
+ * becomes readable when there is output to parse.
+ */
+int ttystartreader(void) {
+  pthread_t thread;
+  size_t size;
+  int i, err;
+
+  for (size = BUFSIZ; size < ringsize; size <<= 1)
+    ;
+  ring.buf = xmalloc<char>(size);
+  ring.mask = size - 1;
+  ring.idle.store(1);
+  if (pipe(ring.wakefd) < 0 || pipe(ring.spacefd) < 0)
+    die("pipe failed: %s\n", strerror(errno));
+  for (i = 0; i < 2; i++) {
+    fcntl(ring.wakefd[i], F_SETFL, O_NONBLOCK);
+    fcntl(ring.wakefd[i], F_SETFD, FD_CLOEXEC);
+    fcntl(ring.spacefd[i], F_SETFL, O_NONBLOCK);
+    fcntl(ring.spacefd[i], F_SETFD, FD_CLOEXEC);
+  }
+  if ((err = pthread_create(&thread, NULL, ttyreader, NULL)))
+    die("pthread_create failed: %s\n", strerror(err));
+  pthread_detach(thread);
+  return ring.wakefd[0];
+}
+
+/* Returns whether there is output left that ttyread() hasn't parsed. */
+int ttypending(void) { return ring.head.load() != ring.tail.load(); }
+
+void *ttyreader(void *unused) {
+  struct pollfd pfd[2] = {{cmdfd, POLLIN, 0}, {ring.spacefd[0], POLLIN, 0}};
+  struct iovec iov[2];
+  size_t head = 0, tail, off, n;
+  ssize_t ret;
+  char drain[64];
+
+  for (;;) {
+    tail = ring.tail.load();
+    if (head - tail > ring.mask) {
+      /* Full: wait for the parser, rechecking once it knows we wait. */
+      ring.full.store(1);
+      ring.stats.full++;
+      if (ring.tail.load() == tail)
+        poll(&pfd[1], 1, -1);
+      while (read(ring.spacefd[0], drain, sizeof(drain)) > 0)
+        ;
+      continue;
+    }
+    /* All free space in one call, in two pieces when it wraps. */
+    off = head & ring.mask;
+    n = ring.mask + 1 - (head - tail);
+    iov[0].iov_base = ring.buf + off;
+    iov[0].iov_len = MIN(n, ring.mask + 1 - off);
+    iov[1].iov_base = ring.buf;
+    iov[1].iov_len = n - iov[0].iov_len;
+    if (slog.fd != -1)
+      ret = ttyreadlog(iov, iov[1].iov_len ? 2 : 1, n);
+    else
+      ret = readv(cmdfd, iov, iov[1].iov_len ? 2 : 1);
+    if (ret < 0) {
+      if (errno == EAGAIN) {
+        ring.stats.waits++;
+        poll(pfd, 1, -1);
+      }
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      /* Linux reports a closed slave side as EIO. */
+      break;
+    }
+    if (ret == 0)
+      break;
+    ring.stats.reads++;
+    ring.stats.bytes += ret;
+    head += ret;
+    ring.head.store(head);
+    if (ring.idle.load() && ring.idle.exchange(0))
+      write(ring.wakefd[1], "", 1);
+    /* A short read drained the pty, skip the read that would fail. */
+    if (ret < n) {
+      ring.stats.waits++;
+      poll(pfd, 1, -1);
+    }
+  }
+  ring.hangup.store(1);
+  write(ring.wakefd[1], "", 1);
+  return NULL;
+}
+
+/* Prints what the reader thread did so far, for tuning the ring. */
+void ttyreport(void) {
+  unsigned long reads = ring.stats.reads;
+  const char *backend = "readv";
+
+  if (slog.fd != -1)
+    backend = slog.splice ? "splice, tee" : "readv, log copy";
+  fprintf(stderr,
+          "mt: tty: %lu reads (%s), %lu bytes per read, %lu waits, %lu times "
+          "full\n",
+          reads, backend, reads ? (unsigned long)ring.stats.bytes / reads : 0,
+          (unsigned long)ring.stats.waits, (unsigned long)ring.stats.full);
+}
+
+/*
+ * Parses buffered program output for about budget ms. Returns the number of
+ * bytes consumed, 0 once the ring is drained.
+ */
+size_t ttyread(long budget) {
+  struct timespec start, now;
+  char part[UTF_SIZ], drain[64];
+  size_t head, tail, off, len, i, j, avail, skip, total = 0;
+  size_t charsize; /* size of utf8 char in bytes */
+  Rune unicodep;
+  int hup;
+
+  hup = ring.hangup.load();
+  while (read(ring.wakefd[0], drain, sizeof(drain)) > 0)
+    ;
+  ring.idle.store(0);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  tail = ring.tail.load(std::memory_order_relaxed);
+  for (;;) {
+    head = ring.head.load();
+    off = tail & ring.mask;
+    /* Don't even parse plain text that scrolls off before the next frame. */
+    skip = tskipscrolled(ring.buf + off, MIN(head - tail, ring.mask + 1 - off));
+    tail += skip;
+    total += skip;
+    off = tail & ring.mask;
+    len = MIN(MIN(head - tail, ring.mask + 1 - off), BUFSIZ);
+    for (i = 0; i < len; i += charsize) {
+      /* String sequence data goes in by the run, not by the char. */
+      if ((charsize = tputstr(ring.buf + off + i, len - i)))
+        continue;
+      if (IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
+        charsize = utf8decode(ring.buf + off + i, &unicodep, len - i);
+        if (charsize == 0) {
+          /* The char continues past the chunk, maybe past the wrap. */
+          avail = MIN(head - tail - i, UTF_SIZ);
+          for (j = 0; j < avail; j++)
+            part[j] = ring.buf[(tail + i + j) & ring.mask];
+          /* keep any uncomplete utf8 char for the next call */
+          if (!(charsize = utf8decode(part, &unicodep, avail)))
+            break;
+        }
+        tputc(unicodep);
+      } else {
+        tputc(ring.buf[off + i] & 0xFF);
+        charsize = 1;
+      }
+    }
+    tail += i;
+    total += i;
+    ring.tail.store(tail);
+    if (ring.full.load() && ring.full.exchange(0))
+      write(ring.spacefd[1], "", 1);
+
+    if (i < len || tail == head) {
+      /* Nothing complete left: ask for a wakeup, then look once more. */
+      if (ring.idle.load())
+        break;
+      ring.idle.store(1);
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (TIMEDIFF(now, start) >= budget)
+      break;
+  }
 
   /*
-   * Remember that we are using a pty, which might be a modem line.
-   * Writing too much will clog the line. That's why we are doing this
-   * dance.
-   * FIXME: Migrate the world to Plan 9.
+   * A hangup usually means the shell is gone, but it may still be running
+   * without its tty. Don't wait for it here; SIGCHLD finishes the exit.
    */
-  while (n > 0) {
-    FD_ZERO(&wfd);
-    FD_ZERO(&rfd);
-    FD_SET(cmdfd, &wfd);
-    FD_SET(cmdfd, &rfd);
-
-    /* Check if we can write. */
-    if (pselect(cmdfd + 1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
+  if (hup && !total)
+    ttyreap(0);
+  return total;
+}
+
+/*
+ * Queues bytes for the child. Whatever the pty doesn't take right away is
+ * written by ttyflush() once the event loop sees cmdfd writable, so callers
+ * never block or read.
+ */
+void ttywrite(const char *s, size_t n) {
+  ssize_t r;
+
+  if (outq.len == 0) {
+    outq.off = 0;
+    if ((r = write(cmdfd, s, n)) < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+        die("write error on tty: %s\n", strerror(errno));
+      r = 0;
+    }
+    s += r;
+    n -= r;
+    if (n == 0)
+      return;
+  }
+  qpush(&outq, s, n);
+}
+
+/*
+ * Queues a reply the terminal generates itself, like DA, DSR or a mouse
+ * report. Replies are never written right away: the event loop's ttyflush()
+ * sends everything from one read or event batch in a single write.
+ */
+void ttyreply(const char *s, size_t n) { qpush(&outq, s, n); }
+
+void qpush(Queue *q, const char *s, size_t n) {
+  if (q->off + q->len + n > q->cap) {
+    memmove(q->buf, q->buf + q->off, q->len);
+    q->off = 0;
+    if (q->len + n > q->cap) {
+      q->cap = MAX(2 * q->cap, q->len + n);
+      q->buf = xrealloc<char>(q->buf, q->cap);
+    }
+  }
+  memcpy(q->buf + q->off + q->len, s, n);
+  q->len += n;
+}
+
+/*
+ * Writes printer batches so that a slow disk or pipe behind -o never stalls
+ * the event loop. Reports drops between batches and gives up on errors.
+ */
+void *printwriter(void *unused) {
+  Queue q = {NULL, 0, 0, 0}, t;
+  size_t dropped;
+
+  pthread_mutex_lock(&printer.lock);
+  for (;;) {
+    printer.busy = 0;
+    pthread_cond_broadcast(&printer.cond);
+    while (printer.q.len == 0 && !printer.dropped)
+      pthread_cond_wait(&printer.cond, &printer.lock);
+    /* Swap buffers, the main thread fills the other one meanwhile. */
+    t = printer.q;
+    printer.q = q;
+    q = t;
+    dropped = printer.dropped;
+    printer.dropped = 0;
+    printer.busy = 1;
+    pthread_mutex_unlock(&printer.lock);
+
+    if (dropped)
+      fprintf(stderr, "mt: printer: dropped %zu bytes\n", dropped);
+    if (q.len > 0 && xwrite(iofd, q.buf + q.off, q.len) < 0)
+      break;
+    q.off = q.len = 0;
+    pthread_mutex_lock(&printer.lock);
+  }
+
+  pthread_mutex_lock(&printer.lock);
+  printer.err = errno;
+  printer.busy = 0;
+  pthread_cond_broadcast(&printer.cond);
+  pthread_mutex_unlock(&printer.lock);
+  free(q.buf);
+  return NULL;
+}
+
+/*
+ * Passes the current batch to the writer thread. A batch that doesn't fit
+ * below printsize behind the ones still pending is dropped whole.
+ */
+void printhandoff(void) {
+  pthread_t thread;
+  int err;
+
+  if (printq.len == 0 || iofd == -1)
+    return;
+
+  pthread_mutex_lock(&printer.lock);
+  if (printer.err) {
+    fprintf(stderr, "Error writing in %s:%s\n", opt_io, strerror(printer.err));
+    close(iofd);
+    iofd = -1;
+  } else if (printer.q.len + printq.len > printsize) {
+    printer.dropped += printq.len;
+  } else {
+    qpush(&printer.q, printq.buf + printq.off, printq.len);
+  }
+  pthread_cond_broadcast(&printer.cond);
+  pthread_mutex_unlock(&printer.lock);
+  printq.off = printq.len = 0;
+
+  if (iofd != -1 && !printer.started) {
+    if ((err = pthread_create(&thread, NULL, printwriter, NULL)))
+      die("pthread_create failed: %s\n", strerror(err));
+    pthread_detach(thread);
+    printer.started = 1;
+  }
+}
+
+/* Hands off the current batch and waits until all of it is written. */
+void printflush(void) {
+  printhandoff();
+  if (!printer.started)
+    return;
+  pthread_mutex_lock(&printer.lock);
+  while (!printer.err && (printer.busy || printer.q.len > 0))
+    pthread_cond_wait(&printer.cond, &printer.lock);
+  pthread_mutex_unlock(&printer.lock);
+}
+
+/*
+ * Writes as much of the pty queue as the pty takes, returns what is left.
+ * Printer output collected since the last call goes to the writer thread.
+ */
+size_t ttyflush(void) {
+  ssize_t r;
+
+  printhandoff();
+  while (outq.len > 0) {
+    if ((r = write(cmdfd, outq.buf + outq.off, outq.len)) < 0) {
       if (errno == EINTR)
         continue;
-      die("select failed: %s\n", strerror(errno));
-    }
-    if (FD_ISSET(cmdfd, &wfd)) {
-      /*
-       * Only write the bytes written by ttywrite() or the
-       * default of 256. This seems to be a reasonable value
-       * for a serial line. Bigger values might clog the I/O.
-       */
-      if ((r = write(cmdfd, s, (n < lim) ? n : lim)) < 0)
-        goto write_error;
-      if (r < n) {
-        /*
-         * We weren't able to write out everything.
-         * This means the buffer is getting full
-         * again. Empty it.
-         */
-        if (n < lim)
-          lim = ttyread();
-        n -= r;
-        s += r;
-      } else {
-        /* All bytes have been written. */
+      if (errno == EAGAIN)
         break;
-      }
+      die("write error on tty: %s\n", strerror(errno));
     }
-    if (FD_ISSET(cmdfd, &rfd))
-      lim = ttyread();
+    outq.off += r;
+    outq.len -= r;
   }
-  return;
-
-write_error:
-  die("write error on tty: %s\n", strerror(errno));
+  return outq.len;
 }
 
 void ttysend(const char *s, size_t n) {
@@ -844,6 +1467,18 @@ void ttyresize(void) {
     fprintf(stderr, "Couldn't set window size: %s\n", strerror(errno));
 }
 
+/* Returns whether s is the tty's interrupt, quit or suspend character. */
+int ttyissignal(const char *s, size_t n) {
+  struct termios t;
+  cc_t c;
+
+  if (n != 1 || tcgetattr(cmdfd, &t) < 0)
+    return 0;
+  c = s[0];
+  return c != _POSIX_VDISABLE &&
+         (c == t.c_cc[VINTR] || c == t.c_cc[VQUIT] || c == t.c_cc[VSUSP]);
+}
+
 int tattrset(int attr) {
   int i, j;
 
@@ -907,6 +1542,8 @@ void treset(void) {
     term.tabs[i] = 1;
   term.top = 0;
   term.bot = term.row - 1;
+  term.left = 0;
+  term.right = term.col - 1;
   term.mode = MODE_WRAP | MODE_UTF8;
   memset(term.trantbl, CS_USA, sizeof(term.trantbl));
   term.charset = 0;
@@ -943,6 +1580,13 @@ void tscrolldown(int orig, int n) {
 
   LIMIT(n, 0, term.bot - orig + 1);
 
+  /* Inside column margins only the span moves, as one rectangle copy. */
+  if (term.left != 0 || term.right != term.col - 1) {
+    tcopyrect(term.left, orig, term.right, term.bot - n, term.left, orig + n);
+    tclearregion(term.left, orig, term.right, orig + n - 1);
+    return;
+  }
+
   tsetdirt(orig, term.bot - n);
   tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
 
@@ -961,6 +1605,12 @@ void tscrollup(int orig, int n) {
 
   LIMIT(n, 0, term.bot - orig + 1);
 
+  if (term.left != 0 || term.right != term.col - 1) {
+    tcopyrect(term.left, orig + n, term.right, term.bot, term.left, orig);
+    tclearregion(term.left, term.bot - n + 1, term.right, term.bot);
+    return;
+  }
+
   tclearregion(0, orig, term.col - 1, orig + n - 1);
   tsetdirt(orig + n, term.bot);
 
@@ -1004,59 +1654,76 @@ void selscroll(int orig, int n) {
 void tnewline(int first_col) {
   int y = term.c.y;
 
+  /* Outside the column margins the cursor stays at the bottom margin. */
   if (y == term.bot) {
-    tscrollup(term.top, 1);
+    if (BETWEEN(term.c.x, term.left, term.right))
+      tscrollup(term.top, 1);
   } else {
     y++;
   }
-  tmoveto(first_col ? 0 : term.c.x, y);
+  tmoveto(first_col ? tleftmargin() : term.c.x, y);
 }
 
+/*
+ * Parameters are accumulated digit by digit and clamp at 65535, missing ones
+ * are 0. Those past ESC_ARG_SIZ, and sub-parameters past ESC_SUB_SIZ, are
+ * skipped. Relies on csireset() having zeroed csiescseq.
+ */
 void csiparse(void) {
-  char *p = csiescseq.buf, *np;
-  long int v;
+  char *p = csiescseq.buf, *end = p + csiescseq.len;
+  int *v = &csiescseq.arg[0], n = 1, i;
 
-  csiescseq.narg = 0;
   if (*p == '?') {
     csiescseq.priv = 1;
     p++;
   }
 
-  csiescseq.buf[csiescseq.len] = '\0';
-  while (p < csiescseq.buf + csiescseq.len) {
-    np = NULL;
-    v = strtol(p, &np, 10);
-    if (np == p)
-      v = 0;
-    if (v == LONG_MAX || v == LONG_MIN)
-      v = -1;
-    csiescseq.arg[csiescseq.narg++] = v;
-    p = np;
-    if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
+  for (; p < end; p++) {
+    if (BETWEEN(*p, '0', '9')) {
+      if (v)
+        *v = MIN(*v * 10 + (*p - '0'), 65535);
+    } else if (*p == ';') {
+      v = n < ESC_ARG_SIZ ? &csiescseq.arg[n] : NULL;
+      n++;
+    } else if (*p == ':') {
+      i = n - 1;
+      if (i < ESC_ARG_SIZ && csiescseq.nsub[i] < ESC_SUB_SIZ)
+        v = &csiescseq.sub[i][csiescseq.nsub[i]++];
+      else
+        v = NULL;
+    } else {
       break;
-    p++;
+    }
   }
-  csiescseq.mode[0] = *p++;
-  csiescseq.mode[1] = (p < csiescseq.buf + csiescseq.len) ? *p : '\0';
+  csiescseq.narg = MIN(n, ESC_ARG_SIZ);
+  csiescseq.mode[0] = (p < end) ? *p++ : '\0';
+  csiescseq.mode[1] = (p < end) ? *p : '\0';
 }
 
 /* for absolute user moves, when decom is set */
 void tmoveato(int x, int y) {
-  tmoveto(x, y + ((term.c.state & CURSOR_ORIGIN) ? term.top : 0));
+  if (term.c.state & CURSOR_ORIGIN)
+    tmoveto(x + term.left, y + term.top);
+  else
+    tmoveto(x, y);
 }
 
 void tmoveto(int x, int y) {
-  int miny, maxy;
+  int minx, maxx, miny, maxy;
 
   if (term.c.state & CURSOR_ORIGIN) {
+    minx = term.left;
+    maxx = term.right;
     miny = term.top;
     maxy = term.bot;
   } else {
+    minx = 0;
+    maxx = term.col - 1;
     miny = 0;
     maxy = term.row - 1;
   }
   term.c.state &= ~CURSOR_WRAPNEXT;
-  term.c.x = LIMIT(x, 0, term.col - 1);
+  term.c.x = LIMIT(x, minx, maxx);
   term.c.y = LIMIT(y, miny, maxy);
 }
 
@@ -1095,6 +1762,134 @@ void tsetchar(Rune u, MTGlyph *attr, int x, int y) {
   term.line[y][x].u = u;
 }
 
+/*
+ * Reads the rectangle of a DEC rectangle operation from args (top, left,
+ * bottom, right, 1-based and relative to the origin) into 0-based screen
+ * coordinates. Returns 0 if nothing of it is on the screen.
+ */
+int trect(int *args, int *x1, int *y1, int *x2, int *y2) {
+  int top = 0, bot = term.row - 1, left = 0, right = term.col - 1;
+
+  if (term.c.state & CURSOR_ORIGIN) {
+    top = term.top;
+    bot = term.bot;
+    left = term.left;
+    right = term.right;
+  }
+  *y1 = (args[0] ? args[0] : 1) - 1 + top;
+  *x1 = (args[1] ? args[1] : 1) - 1 + left;
+  *y2 = args[2] ? args[2] - 1 + top : bot;
+  *x2 = args[3] ? args[3] - 1 + left : right;
+  LIMIT(*y2, 0, bot);
+  LIMIT(*x2, 0, right);
+  return *y1 <= *y2 && *x1 <= *x2 && *x1 >= 0 && *y1 >= 0;
+}
+
+/* Clears the selection if it has cells in rows y1 to y2. */
+void tselclearrows(int y1, int y2) {
+  if (sel.ob.x != -1 && sel.nb.y <= y2 && sel.ne.y >= y1)
+    selclear();
+}
+
+/*
+ * Blanks the halves outside columns x1 to x2 of row y of wide chars that the
+ * edges cut through, before the cells inside change.
+ */
+void tcutwide(int x1, int x2, int y) {
+  MTGlyph *line = term.line[y];
+
+  if (x1 > 0 && (line[x1].mode & ATTR_WDUMMY)) {
+    line[x1 - 1].u = ' ';
+    line[x1 - 1].mode &= ~ATTR_WIDE;
+  }
+  if (x2 + 1 < term.col && (line[x2].mode & ATTR_WIDE)) {
+    line[x2 + 1].u = ' ';
+    line[x2 + 1].mode &= ~ATTR_WDUMMY;
+  }
+}
+
+/* Fills a rectangle with u in the current attributes (DECFRA). */
+void tfillrect(int x1, int y1, int x2, int y2, Rune u) {
+  MTGlyph g = term.c.attr;
+  int y;
+
+  g.u = u;
+  g.mode &= ~(ATTR_WRAP | ATTR_WIDE | ATTR_WDUMMY);
+  tselclearrows(y1, y2);
+  for (y = y1; y <= y2; y++) {
+    tcutwide(x1, x2, y);
+    std::fill(&term.line[y][x1], &term.line[y][x2 + 1], g);
+    term.dirty[y] = 1;
+  }
+}
+
+/*
+ * Copies a rectangle so that its top left corner ends up at x, y (DECCRA),
+ * clipping both the source and the copy at the screen edges. Overlapping
+ * rectangles copy correctly.
+ */
+void tcopyrect(int x1, int y1, int x2, int y2, int x, int y) {
+  int i, n, h;
+
+  if (x1 < 0 || y1 < 0 || x < 0 || y < 0)
+    return;
+  n = MIN(MIN(x2, term.col - 1) - x1, term.col - 1 - x) + 1;
+  h = MIN(MIN(y2, term.row - 1) - y1, term.row - 1 - y) + 1;
+  if (n <= 0 || h <= 0)
+    return;
+  tselclearrows(y, y + h - 1);
+  /* Rows in the order that doesn't overwrite rows still to be copied. */
+  for (i = 0; i < h; i++) {
+    int r = y > y1 ? h - 1 - i : i;
+    MTGlyph *line = term.line[y + r];
+    /* The cells just outside may be source cells, so cut after the copy. */
+    int left = line[x].mode & ATTR_WDUMMY;
+    int right = line[x + n - 1].mode & ATTR_WIDE;
+
+    memmove(&line[x], &term.line[y1 + r][x1], n * sizeof(MTGlyph));
+    if (left && x > 0) {
+      line[x - 1].u = ' ';
+      line[x - 1].mode &= ~ATTR_WIDE;
+    }
+    if (right && x + n < term.col) {
+      line[x + n].u = ' ';
+      line[x + n].mode &= ~ATTR_WDUMMY;
+    }
+    /* Halves copied without their partner. */
+    if (line[x].mode & ATTR_WDUMMY) {
+      line[x].u = ' ';
+      line[x].mode &= ~ATTR_WDUMMY;
+    }
+    if (line[x + n - 1].mode & ATTR_WIDE) {
+      line[x + n - 1].u = ' ';
+      line[x + n - 1].mode &= ~ATTR_WIDE;
+    }
+    term.dirty[y + r] = 1;
+  }
+}
+
+/* Erases the cells in a rectangle that DECSCA didn't protect (DECSERA). */
+void tselerase(int x1, int y1, int x2, int y2) {
+  MTGlyph *gp;
+  int x, y;
+
+  tselclearrows(y1, y2);
+  for (y = y1; y <= y2; y++) {
+    for (x = x1; x <= x2; x++) {
+      gp = &term.line[y][x];
+      if (gp->mode & ATTR_PROTECTED)
+        continue;
+      if (x == x1 || x == x2)
+        tcutwide(x, x, y);
+      gp->fg = term.c.attr.fg;
+      gp->bg = term.c.attr.bg;
+      gp->mode = 0;
+      gp->u = ' ';
+    }
+    term.dirty[y] = 1;
+  }
+}
+
 void tclearregion(int x1, int y1, int x2, int y2) {
   int x, y, temp;
   MTGlyph *gp;
@@ -1111,6 +1906,7 @@ void tclearregion(int x1, int y1, int x2, int y2) {
 
   for (y = y1; y <= y2; y++) {
     term.dirty[y] = 1;
+    tcutwide(x1, x2, y);
     for (x = x1; x <= x2; x++) {
       gp = &term.line[y][x];
       if (selected(x, y))
@@ -1127,26 +1923,31 @@ void tdeletechar(int n) {
   int dst, src, size;
   MTGlyph *line;
 
-  LIMIT(n, 0, term.col - term.c.x);
+  /* Outside the column margins there is nothing to shift. */
+  if (!BETWEEN(term.c.x, term.left, term.right))
+    return;
+  LIMIT(n, 0, term.right + 1 - term.c.x);
 
   dst = term.c.x;
   src = term.c.x + n;
-  size = term.col - src;
+  size = term.right + 1 - src;
   line = term.line[term.c.y];
 
   memmove(&line[dst], &line[src], size * sizeof(MTGlyph));
-  tclearregion(term.col - n, term.c.y, term.col - 1, term.c.y);
+  tclearregion(term.right + 1 - n, term.c.y, term.right, term.c.y);
 }
 
 void tinsertblank(int n) {
   int dst, src, size;
   MTGlyph *line;
 
-  LIMIT(n, 0, term.col - term.c.x);
+  if (!BETWEEN(term.c.x, term.left, term.right))
+    return;
+  LIMIT(n, 0, term.right + 1 - term.c.x);
 
   dst = term.c.x + n;
   src = term.c.x;
-  size = term.col - dst;
+  size = term.right + 1 - dst;
   line = term.line[term.c.y];
 
   memmove(&line[dst], &line[src], size * sizeof(MTGlyph));
@@ -1154,64 +1955,95 @@ void tinsertblank(int n) {
 }
 
 void tinsertblankline(int n) {
-  if (BETWEEN(term.c.y, term.top, term.bot))
+  if (BETWEEN(term.c.y, term.top, term.bot) &&
+      BETWEEN(term.c.x, term.left, term.right))
     tscrolldown(term.c.y, n);
 }
 
 void tdeleteline(int n) {
-  if (BETWEEN(term.c.y, term.top, term.bot))
+  if (BETWEEN(term.c.y, term.top, term.bot) &&
+      BETWEEN(term.c.x, term.left, term.right))
     tscrollup(term.c.y, n);
 }
 
-int32_t tdefcolor(int *attr, int *npar, int l) {
+/*
+ * Reads the color after the 38, 48 or 58 at csi->arg[*npar]: "5;idx" or
+ * "2;r;g;b" in the following args, or as sub-parameters "5:idx", "2:r:g:b"
+ * and "2:cs:r:g:b", where the color space id cs is ignored. Returns -1 when
+ * there is no usable color.
+ */
+int32_t tdefcolor(const CSIEscape *csi, int *npar) {
   int32_t idx = -1;
+  const int *spec;
+  int n, used = 0;
   uint r, g, b;
 
-  switch (attr[*npar + 1]) {
+  if (csi->nsub[*npar]) {
+    spec = csi->sub[*npar];
+    n = csi->nsub[*npar];
+  } else {
+    spec = &csi->arg[*npar + 1];
+    n = csi->narg - *npar - 1;
+  }
+
+  switch (n ? spec[0] : -1) {
   case 2: /* direct color in RGB space */
-    if (*npar + 4 >= l) {
+    if (n < 4) {
       fprintf(stderr, "erresc(38): Incorrect number of parameters (%d)\n",
-              *npar);
+              n);
+      used = n;
       break;
     }
-    r = attr[*npar + 2];
-    g = attr[*npar + 3];
-    b = attr[*npar + 4];
-    *npar += 4;
+    /* Only the colon form has room for the color space. */
+    used = (csi->nsub[*npar] && n >= 5) ? 5 : 4;
+    r = spec[used - 3];
+    g = spec[used - 2];
+    b = spec[used - 1];
     if (!BETWEEN(r, 0, 255) || !BETWEEN(g, 0, 255) || !BETWEEN(b, 0, 255))
       fprintf(stderr, "erresc: bad rgb color (%u,%u,%u)\n", r, g, b);
     else
       idx = TRUECOLOR(r, g, b);
     break;
   case 5: /* indexed color */
-    if (*npar + 2 >= l) {
+    if (n < 2) {
       fprintf(stderr, "erresc(38): Incorrect number of parameters (%d)\n",
-              *npar);
+              n);
+      used = n;
       break;
     }
-    *npar += 2;
-    if (!BETWEEN(attr[*npar], 0, 255))
-      fprintf(stderr, "erresc: bad fgcolor %d\n", attr[*npar]);
+    used = 2;
+    if (!BETWEEN(spec[1], 0, 255))
+      fprintf(stderr, "erresc: bad fgcolor %d\n", spec[1]);
     else
-      idx = attr[*npar];
+      idx = spec[1];
     break;
   case 0: /* implemented defined (only foreground) */
   case 1: /* transparent */
   case 3: /* direct color in CMY space */
   case 4: /* direct color in CMYK space */
   default:
-    fprintf(stderr, "erresc(38): gfx attr %d unknown\n", attr[*npar]);
+    if (!n) {
+      fprintf(stderr, "erresc(38): missing color type\n");
+      break;
+    }
+    /* Skip the unknown type, rather than read it as an attribute. */
+    fprintf(stderr, "erresc(38): gfx attr %d unknown\n", spec[0]);
+    used = 1;
     break;
   }
 
+  /* Sub-parameters belong to the arg, others have to be skipped. */
+  if (!csi->nsub[*npar])
+    *npar += used;
   return idx;
 }
 
-void tsetattr(int *attr, int l) {
+void tsetattr(const CSIEscape *csi) {
+  const int *attr = csi->arg;
   int i;
   int32_t idx;
 
-  for (i = 0; i < l; i++) {
+  for (i = 0; i < csi->narg; i++) {
     switch (attr[i]) {
     case 0:
       term.c.attr.mode &=
@@ -1230,7 +2062,11 @@ void tsetattr(int *attr, int l) {
       term.c.attr.mode |= ATTR_ITALIC;
       break;
     case 4:
-      term.c.attr.mode |= ATTR_UNDERLINE;
+      /* 4:0 is no underline; 4:1 to 4:5 are styles, all drawn single. */
+      if (csi->nsub[i] && !csi->sub[i][0])
+        term.c.attr.mode &= ~ATTR_UNDERLINE;
+      else
+        term.c.attr.mode |= ATTR_UNDERLINE;
       break;
     case 5: /* slow blink */
             /* FALLTHROUGH */
@@ -1268,19 +2104,24 @@ void tsetattr(int *attr, int l) {
       term.c.attr.mode &= ~ATTR_STRUCK;
       break;
     case 38:
-      if ((idx = tdefcolor(attr, &i, l)) >= 0)
+      if ((idx = tdefcolor(csi, &i)) >= 0)
         term.c.attr.fg = idx;
       break;
     case 39:
       term.c.attr.fg = defaultfg;
       break;
     case 48:
-      if ((idx = tdefcolor(attr, &i, l)) >= 0)
+      if ((idx = tdefcolor(csi, &i)) >= 0)
         term.c.attr.bg = idx;
       break;
     case 49:
       term.c.attr.bg = defaultbg;
       break;
+    case 58: /* underline color, underlines are drawn in fg */
+      tdefcolor(csi, &i);
+      break;
+    case 59:
+      break;
     default:
       if (BETWEEN(attr[i], 30, 37)) {
         term.c.attr.fg = attr[i] - 30;
@@ -1313,6 +2154,81 @@ void tsetscroll(int t, int b) {
   term.bot = b;
 }
 
+/* Sets the column margins (DECSLRM), ignoring empty or inverted ones. */
+void tsetmargins(int l, int r) {
+  LIMIT(l, 0, term.col - 1);
+  LIMIT(r, 0, term.col - 1);
+  if (l >= r)
+    return;
+  term.left = l;
+  term.right = r;
+}
+
+/* Where CR and wrapping return to: the left margin when inside it. */
+int tleftmargin(void) { return term.c.x >= term.left ? term.left : 0; }
+
+/*
+ * Returns the DECRQM state of a mode: 1 set, 2 reset, 4 permanently reset
+ * and 0 for modes that aren't known.
+ */
+int tgetmode(int priv, int mode) {
+  static const struct {
+    int mode, flag;
+  } privmodes[] = {
+      {1, MODE_APPCURSOR},   {5, MODE_REVERSE},     {7, MODE_WRAP},
+      {9, MODE_MOUSEX10},    {1000, MODE_MOUSEBTN}, {1002, MODE_MOUSEMOTION},
+      {1003, MODE_MOUSEMANY}, {1004, MODE_FOCUS},   {1006, MODE_MOUSESGR},
+      {1034, MODE_8BIT},     {1049, MODE_ALTSCREEN}, {2004, MODE_BRCKTPASTE},
+      {69, MODE_LRMARGIN},   {2026, MODE_SYNC},
+  },
+    ansimodes[] = {
+        {2, MODE_KBDLOCK}, {4, MODE_INSERT}, {20, MODE_CRLF},
+    };
+  int i;
+
+  if (!priv) {
+    if (mode == 12) /* SRM is set when local echo is off */
+      return IS_SET(MODE_ECHO) ? 2 : 1;
+    for (i = 0; i < LEN(ansimodes); i++) {
+      if (ansimodes[i].mode == mode)
+        return IS_SET(ansimodes[i].flag) ? 1 : 2;
+    }
+    return 0;
+  }
+  switch (mode) {
+  case 6:
+    return (term.c.state & CURSOR_ORIGIN) ? 1 : 2;
+  case 25:
+    return IS_SET(MODE_HIDE) ? 2 : 1;
+  case 1001: /* not implemented, see tsetmode() */
+  case 1005:
+  case 1015:
+    return 4;
+  }
+  for (i = 0; i < LEN(privmodes); i++) {
+    if (privmodes[i].mode == mode)
+      return IS_SET(privmodes[i].flag) ? 1 : 2;
+  }
+  return 0;
+}
+
+/*
+ * Returns for how many more ms frames are held for synchronized output, 0
+ * when they aren't. An update that never ends is cut off after synctimeout.
+ */
+long tsynchold(void) {
+  struct timespec now;
+  long left;
+
+  if (!IS_SET(MODE_SYNC))
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if ((left = synctimeout - (long)TIMEDIFF(now, term.synced)) > 0)
+    return left;
+  term.mode &= ~MODE_SYNC;
+  return 0;
+}
+
 void tsetmode(int priv, int set, int *args, int narg) {
   int *lim, mode;
   int alt;
@@ -1402,6 +2318,16 @@ void tsetmode(int priv, int set, int *args, int narg) {
       case 2004: /* 2004: bracketed paste mode */
         MODBIT(term.mode, set, MODE_BRCKTPASTE);
         break;
+      case 2026: /* 2026: synchronized output, frames wait for the reset */
+        if (set && !IS_SET(MODE_SYNC))
+          clock_gettime(CLOCK_MONOTONIC, &term.synced);
+        MODBIT(term.mode, set, MODE_SYNC);
+        break;
+      case 69: /* DECLRMM -- allow DECSLRM, resetting drops the margins */
+        MODBIT(term.mode, set, MODE_LRMARGIN);
+        term.left = 0;
+        term.right = term.col - 1;
+        break;
       /* Not implemented mouse modes. See comments there. */
       case 1001: /* mouse highlight mode; can hang the
                     terminal by design when implemented. */
@@ -1441,7 +2367,7 @@ void tsetmode(int priv, int set, int *args, int narg) {
 
 void csihandle(void) {
   char buf[40];
-  int len;
+  int len, x1, y1, x2, y2;
 
   switch (csiescseq.mode[0]) {
   default:
@@ -1484,7 +2410,7 @@ void csihandle(void) {
     break;
   case 'c': /* DA -- Device Attributes */
     if (csiescseq.arg[0] == 0)
-      ttywrite(vt102_identify, strlen(vt102_identify));
+      ttyreply(vt102_identify, strlen(vt102_identify));
     break;
   case 'C': /* CUF -- Cursor <n> Forward */
   case 'a': /* HPR -- Cursor <n> Forward */
@@ -1603,13 +2529,13 @@ void csihandle(void) {
     tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
     break;
   case 'm': /* SGR -- Terminal attribute (color) */
-    tsetattr(csiescseq.arg, csiescseq.narg);
+    tsetattr(&csiescseq);
     break;
   case 'n': /* DSR – Device Status Report (cursor position) */
     if (csiescseq.arg[0] == 6) {
       len =
           snprintf(buf, sizeof(buf), "\033[%i;%iR", term.c.y + 1, term.c.x + 1);
-      ttywrite(buf, len);
+      ttyreply(buf, len);
     }
     break;
   case 'r': /* DECSTBM -- Set Scrolling Region */
@@ -1622,12 +2548,69 @@ void csihandle(void) {
       tmoveato(0, 0);
     }
     break;
-  case 's': /* DECSC -- Save cursor position (ANSI.SYS) */
-    tcursor(CURSOR_SAVE);
+  case 's':
+    if (IS_SET(MODE_LRMARGIN)) { /* DECSLRM -- Set left and right margins */
+      DEFAULT(csiescseq.arg[0], 1);
+      DEFAULT(csiescseq.arg[1], term.col);
+      tsetmargins(csiescseq.arg[0] - 1, csiescseq.arg[1] - 1);
+      tmoveato(0, 0);
+    } else { /* DECSC -- Save cursor position (ANSI.SYS) */
+      tcursor(CURSOR_SAVE);
+    }
     break;
   case 'u': /* DECRC -- Restore cursor position (ANSI.SYS) */
     tcursor(CURSOR_LOAD);
     break;
+  case 'b': /* REP -- Repeat the preceding graphic character */
+    DEFAULT(csiescseq.arg[0], 1);
+    LIMIT(csiescseq.arg[0], 1, 65535);
+    for (len = 0; term.lastc && len < csiescseq.arg[0]; len++)
+      tputc(term.lastc);
+    break;
+  case '"':
+    switch (csiescseq.mode[1]) {
+    case 'q': /* DECSCA -- Select character protection attribute */
+      MODBIT(term.c.attr.mode, csiescseq.arg[0] == 1, ATTR_PROTECTED);
+      break;
+    default:
+      goto unknown;
+    }
+    break;
+  case '$':
+    switch (csiescseq.mode[1]) {
+    case 'x': /* DECFRA -- Fill rectangular area */
+      if ((BETWEEN(csiescseq.arg[0], 32, 126) ||
+           BETWEEN(csiescseq.arg[0], 160, 255)) &&
+          trect(csiescseq.arg + 1, &x1, &y1, &x2, &y2))
+        tfillrect(x1, y1, x2, y2, csiescseq.arg[0]);
+      break;
+    case 'z': /* DECERA -- Erase rectangular area */
+      if (trect(csiescseq.arg, &x1, &y1, &x2, &y2))
+        tclearregion(x1, y1, x2, y2);
+      break;
+    case '{': /* DECSERA -- Selective erase rectangular area */
+      if (trect(csiescseq.arg, &x1, &y1, &x2, &y2))
+        tselerase(x1, y1, x2, y2);
+      break;
+    case 'v': /* DECCRA -- Copy rectangular area, pages are ignored */
+      if (trect(csiescseq.arg, &x1, &y1, &x2, &y2)) {
+        /* The destination's top left corner, as a rectangle of its own. */
+        int dst[4] = {csiescseq.arg[5], csiescseq.arg[6], 0, 0}, x, y, bx, by;
+
+        if (trect(dst, &x, &y, &bx, &by))
+          tcopyrect(x1, y1, x2, y2, x, y);
+      }
+      break;
+    case 'p': /* DECRQM -- Request mode */
+      len = snprintf(buf, sizeof(buf), "\033[%s%d;%d$y",
+                     csiescseq.priv ? "?" : "", csiescseq.arg[0],
+                     tgetmode(csiescseq.priv, csiescseq.arg[0]));
+      ttyreply(buf, len);
+      break;
+    default:
+      goto unknown;
+    }
+    break;
   case ' ':
     switch (csiescseq.mode[1]) {
     case 'q': /* DECSCUSR -- Set Cursor Style */
@@ -1673,6 +2656,10 @@ void strhandle(void) {
   int j, narg, par;
 
   term.esc &= ~(ESC_STR_END | ESC_STR);
+  if (strescseq.toolong) {
+    fprintf(stderr, "erresc: str longer than %u bytes dropped\n", strsize);
+    return;
+  }
   strparse();
   par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -1686,16 +2673,23 @@ void strhandle(void) {
         xsettitle(strescseq.args[1]);
       return;
     case 52:
-      if (narg > 2) {
-        char *dec;
-
-        dec = base64dec(strescseq.args[2]);
-        if (dec) {
-          xsetsel(dec, CurrentTime);
-          clipcopy(NULL);
-        } else {
-          fprintf(stderr, "erresc: invalid base64\n");
+      if (strescseq.payload) {
+        char *dec = strescseq.buf;
+        size_t n = strescseq.len - strescseq.payload;
+
+        if (strescseq.b64.state < 0 || strescseq.b64.bits == 6) {
+          /* "?" asks for the clipboard, which programs can't read. */
+          if (strescseq.b64.bad != '?' || strescseq.len != strescseq.payload)
+            fprintf(stderr, "erresc: invalid base64\n");
+          return;
         }
+        /* The selection takes the buffer over, a new one comes with reset. */
+        memmove(dec, dec + strescseq.payload, n);
+        dec[n] = '\0';
+        strescseq.buf = NULL;
+        strescseq.siz = 0;
+        xsetsel(dec, CurrentTime);
+        clipcopy(NULL);
       }
       return;
     case 4: /* color set */
@@ -1736,7 +2730,9 @@ void strparse(void) {
   char *p = strescseq.buf;
 
   strescseq.narg = 0;
-  strescseq.buf[strescseq.len] = '\0';
+  /* A decoded OSC 52 payload is binary, only the arguments before it count. */
+  strescseq.buf[strescseq.payload ? strescseq.payload - 1 : strescseq.len] =
+      '\0';
 
   if (*p == '\0')
     return;
@@ -1752,7 +2748,7 @@ void strparse(void) {
 }
 
 void strdump(void) {
-  int i;
+  size_t i;
   uint c;
 
   fprintf(stderr, "ESC%c", strescseq.type);
@@ -1776,19 +2772,94 @@ void strdump(void) {
   fprintf(stderr, "ESC\\\n");
 }
 
-void strreset(void) { memset(&strescseq, 0, sizeof(strescseq)); }
+/* Keeps the buffer for the next string, unless it grew for a big one. */
+void strreset(void) {
+  char *buf = strescseq.buf;
+  size_t siz = strescseq.siz;
+
+  if (siz != STR_BUF_SIZ) {
+    free(buf);
+    buf = xmalloc<char>(siz = STR_BUF_SIZ);
+  }
+  memset(&strescseq, 0, sizeof(strescseq));
+  strescseq.buf = buf;
+  strescseq.siz = siz;
+}
+
+/*
+ * Appends to the string sequence, doubling the buffer as it fills. A string
+ * longer than strsize is dropped whole rather than cut short. Once the
+ * "52;<selection>;" of an OSC 52 is in, its data is decoded as it arrives.
+ */
+void strput(const char *s, size_t n) {
+  size_t need;
+  char *p;
+
+  if (strescseq.toolong)
+    return;
+  need = strescseq.len + (strescseq.payload ? n / 4 * 3 + 3 : n) + 1;
+  if (need > strsize) {
+    strescseq.toolong = 1;
+    return;
+  }
+  if (need > strescseq.siz) {
+    strescseq.siz = MAX(need, strescseq.siz * 2);
+    strescseq.buf = xrealloc<char>(strescseq.buf, strescseq.siz);
+  }
+
+  if (strescseq.payload) {
+    strescseq.len += base64dec(&strescseq.b64, s, n,
+                               strescseq.buf + strescseq.len);
+    return;
+  }
+  memcpy(strescseq.buf + strescseq.len, s, n);
+  strescseq.len += n;
+  if (strescseq.type == ']' && strescseq.len > 3 &&
+      !memcmp(strescseq.buf, "52;", 3) &&
+      (p = (char *)memchr(strescseq.buf + 3, ';', strescseq.len - 3))) {
+    strescseq.payload = ++p - strescseq.buf;
+    strescseq.len = strescseq.payload +
+                    base64dec(&strescseq.b64, p,
+                              strescseq.buf + strescseq.len - p, p);
+  }
+}
+
+/*
+ * Appends the run of printable ASCII at the start of s to the string sequence
+ * being received, if any, in one go. Returns the bytes taken.
+ */
+size_t tputstr(const char *s, size_t n) {
+  size_t len;
+
+  if (!(term.esc & ESC_STR) || !strescseq.len ||
+      IS_SET(MODE_PRINT | MODE_SIXEL))
+    return 0;
+  for (len = 0; len < n && BETWEEN(s[len], ' ', '~'); len++)
+    ;
+  if (len)
+    strput(s, len);
+  return len;
+}
 
 void sendbreak(const Arg *arg) {
   if (tcsendbreak(cmdfd, 0))
     perror("Error sending break");
 }
 
+/*
+ * Collects printer output into the current batch, which ttyflush() hands to
+ * the writer thread. Past printsize the output is dropped and counted.
+ */
 void tprinter(const char *s, size_t len) {
-  if (iofd != -1 && xwrite(iofd, s, len) < 0) {
-    fprintf(stderr, "Error writing in %s:%s\n", opt_io, strerror(errno));
-    close(iofd);
-    iofd = -1;
+  if (iofd == -1)
+    return;
+  if (printq.len + len > printsize) {
+    pthread_mutex_lock(&printer.lock);
+    printer.dropped += len;
+    pthread_mutex_unlock(&printer.lock);
+    return;
   }
+  qpush(&printq, s, len);
 }
 
 void iso14755(const Arg *arg) {
@@ -1828,24 +2899,38 @@ void tdumpsel(void) {
   }
 }
 
-void tdumpline(int n) {
-  char buf[UTF_SIZ];
+/* Encodes row n into buf, which has room for term.col * UTF_SIZ + 1 bytes. */
+size_t tencodeline(int n, char *buf) {
   MTGlyph *bp, *end;
+  size_t len = 0;
 
   bp = &term.line[n][0];
   end = &bp[MIN(tlinelen(n), term.col) - 1];
   if (bp != end || bp->u != ' ') {
     for (; bp <= end; ++bp)
-      tprinter(buf, utf8encode(bp->u, buf));
+      len += utf8encode(bp->u, buf + len);
   }
-  tprinter("\n", 1);
+  buf[len++] = '\n';
+  return len;
 }
 
+void tdumpline(int n) {
+  char *buf = xmalloc<char>(term.col * UTF_SIZ + 1);
+
+  tprinter(buf, tencodeline(n, buf));
+  free(buf);
+}
+
+/* The whole screen goes to the printer as one piece. */
 void tdump(void) {
+  size_t len = 0;
+  char *buf = xmalloc<char>(term.row * (term.col * UTF_SIZ + 1));
   int i;
 
   for (i = 0; i < term.row; ++i)
-    tdumpline(i);
+    len += tencodeline(i, buf + len);
+  tprinter(buf, len);
+  free(buf);
 }
 
 void tputtab(int n) {
@@ -1938,7 +3023,7 @@ void tcontrolcode(uchar ascii) {
     tmoveto(term.c.x - 1, term.c.y);
     return;
   case '\r': /* CR */
-    tmoveto(0, term.c.y);
+    tmoveto(tleftmargin(), term.c.y);
     return;
   case '\f': /* LF */
   case '\v': /* VT */
@@ -2010,7 +3095,7 @@ void tcontrolcode(uchar ascii) {
   case 0x99: /* TODO: SGCI */
     break;
   case 0x9a: /* DECID -- Identify Terminal */
-    ttywrite(vt102_identify, strlen(vt102_identify));
+    ttyreply(vt102_identify, strlen(vt102_identify));
     break;
   case 0x9b: /* TODO: CSI */
   case 0x9c: /* TODO: ST */
@@ -2061,7 +3146,8 @@ int eschandle(uchar ascii) {
     return 0;
   case 'D': /* IND -- Linefeed */
     if (term.c.y == term.bot) {
-      tscrollup(term.top, 1);
+      if (BETWEEN(term.c.x, term.left, term.right))
+        tscrollup(term.top, 1);
     } else {
       tmoveto(term.c.x, term.c.y + 1);
     }
@@ -2074,13 +3160,14 @@ int eschandle(uchar ascii) {
     break;
   case 'M': /* RI -- Reverse index */
     if (term.c.y == term.top) {
-      tscrolldown(term.top, 1);
+      if (BETWEEN(term.c.x, term.left, term.right))
+        tscrolldown(term.top, 1);
     } else {
       tmoveto(term.c.x, term.c.y - 1);
     }
     break;
   case 'Z': /* DECID -- Identify Terminal */
-    ttywrite(vt102_identify, strlen(vt102_identify));
+    ttyreply(vt102_identify, strlen(vt102_identify));
     break;
   case 'c': /* RIS -- Reset to inital state */
     treset();
@@ -2111,10 +3198,80 @@ int eschandle(uchar ascii) {
   return 1;
 }
 
+/*
+ * Looks at the run of printable ASCII, CR and LF at the start of s. If it
+ * scrolls the whole screen away by itself, the part before the last term.row
+ * scrolls can't ever be seen. Skips that part, applying only the cursor
+ * movement, and returns how many bytes were consumed.
+ */
+size_t tskipscrolled(const char *s, size_t n) {
+  int pass, x, y, wrapnext;
+  int wrap = IS_SET(MODE_WRAP), crlf = IS_SET(MODE_CRLF);
+  size_t i, len, scrolls, target;
+  uchar c;
+
+  /* Anything that keeps track of what was on the screen needs every cell. */
+  if (term.esc || sel.ob.x != -1 || IS_SET(MODE_INSERT | MODE_PRINT) ||
+      term.top != 0 || term.bot != term.row - 1 || term.left != 0 ||
+      term.right != term.col - 1)
+    return 0;
+
+  n = MIN(n, 1 << 16);
+  for (len = 0; len < n; len++) {
+    c = s[len];
+    if (!BETWEEN(c, ' ', '~') && c != '\r' && c != '\n' && c != '\v' &&
+        c != '\f')
+      break;
+  }
+
+  /* Count the scrolls, then find the start of the last term.row of them. */
+  target = SIZE_MAX;
+  for (pass = 0; pass < 2; pass++) {
+    x = term.c.x;
+    y = term.c.y;
+    wrapnext = term.c.state & CURSOR_WRAPNEXT;
+    scrolls = 0;
+    for (i = 0; i < len; i++) {
+      c = s[i];
+      if (c == '\r') {
+        x = wrapnext = 0;
+        continue;
+      }
+      if (!BETWEEN(c, ' ', '~') || (wrap && wrapnext)) {
+        if (y < term.row - 1)
+          y++;
+        else if (scrolls++ == target)
+          break;
+        if (BETWEEN(c, ' ', '~') || crlf)
+          x = 0;
+        wrapnext = 0;
+        if (!BETWEEN(c, ' ', '~'))
+          continue;
+      }
+      if (x + 1 < term.col)
+        x++;
+      else
+        wrapnext = 1;
+    }
+    if (pass == 0) {
+      if (scrolls < term.row)
+        return 0;
+      target = scrolls - term.row;
+    }
+  }
+
+  term.c.x = x;
+  term.c.y = y;
+  MODBIT(term.c.state, wrapnext, CURSOR_WRAPNEXT);
+  /* REP repeats the last char printed, skipped or not, if nothing followed. */
+  term.lastc = BETWEEN(s[i - 1], ' ', '~') ? s[i - 1] : 0;
+  return i;
+}
+
 void tputc(Rune u) {
   char c[UTF_SIZ];
   int control;
-  int width, len;
+  int width, len, right;
   MTGlyph *gp;
 
   control = ISCONTROL(u);
@@ -2157,25 +3314,7 @@ void tputc(Rune u) {
     if (term.esc & ESC_DCS && strescseq.len == 0 && u == 'q')
       term.mode |= MODE_SIXEL;
 
-    if (strescseq.len + len >= sizeof(strescseq.buf) - 1) {
-      /*
-       * Here is a bug in terminals. If the user never sends
-       * some code to stop the str or esc command, then st
-       * will stop responding. But this is better than
-       * silently failing with unknown characters. At least
-       * then users will report back.
-       *
-       * In the case users ever get fixed, here is the code:
-       */
-      /*
-       * term.esc = 0;
-       * strhandle();
-       */
-      return;
-    }
-
-    memmove(&strescseq.buf[strescseq.len], c, len);
-    strescseq.len += len;
+    strput(c, len);
     return;
   }
 
@@ -2190,6 +3329,8 @@ check_control_code:
     /*
      * control codes are not shown ever
      */
+    if (!term.esc)
+      term.lastc = 0;
     return;
   } else if (term.esc & ESC_START) {
     if (term.esc & ESC_CSI) {
@@ -2199,6 +3340,9 @@ check_control_code:
         term.esc = 0;
         csiparse();
         csihandle();
+        /* REP only follows a graphic character, or the one it repeated. */
+        if (csiescseq.mode[0] != 'b')
+          term.lastc = 0;
       }
       return;
     } else if (term.esc & ESC_UTF8) {
@@ -2213,6 +3357,7 @@ check_control_code:
       /* sequence already finished */
     }
     term.esc = 0;
+    term.lastc = 0;
     /*
      * All characters which form part of a sequence are not
      * printed
@@ -2229,15 +3374,18 @@ check_control_code:
     gp = &term.line[term.c.y][term.c.x];
   }
 
-  if (IS_SET(MODE_INSERT) && term.c.x + width < term.col)
-    memmove(gp + width, gp, (term.col - term.c.x - width) * sizeof(MTGlyph));
+  /* Inside the column margins, lines wrap at the right one. */
+  right = term.c.x <= term.right ? term.right + 1 : term.col;
+  if (IS_SET(MODE_INSERT) && term.c.x + width < right)
+    memmove(gp + width, gp, (right - term.c.x - width) * sizeof(MTGlyph));
 
-  if (term.c.x + width > term.col) {
+  if (term.c.x + width > right) {
     tnewline(1);
     gp = &term.line[term.c.y][term.c.x];
   }
 
   tsetchar(u, &term.c.attr, term.c.x, term.c.y);
+  term.lastc = u;
 
   if (width == 2) {
     gp->mode |= ATTR_WIDE;
@@ -2246,7 +3394,7 @@ check_control_code:
       gp[1].mode = ATTR_WDUMMY;
     }
   }
-  if (term.c.x + width < term.col) {
+  if (term.c.x + width < right) {
     tmoveto(term.c.x + width, term.c.y);
   } else {
     term.c.state |= CURSOR_WRAPNEXT;
@@ -2285,7 +3433,6 @@ void tresize(int col, int row) {
   }
 
   /* resize to new width */
-  term.specbuf = xrealloc<XftGlyphFontSpec>(term.specbuf, col);
 
   /* resize to new height */
   term.line = xrealloc<Line>(term.line, row * sizeof(Line));
@@ -2328,6 +3475,8 @@ void tresize(int col, int row) {
   term.row = row;
   /* reset scrolling region */
   tsetscroll(0, row - 1);
+  term.left = 0;
+  term.right = col - 1;
   /* make use of the LIMIT in tmoveto */
   tmoveto(term.c.x, term.c.y);
   /* Clearing both screens (it makes dirty all lines) */
@@ -2351,9 +3500,11 @@ void zoom(const Arg *arg) {
 }
 
 void zoomabs(const Arg *arg) {
+  xlock();
   xunloadfonts();
   xloadfonts(usedfont, arg->f);
   cresize(0, 0);
+  xunlock();
   ttyresize();
   redraw();
   xhints();
@@ -2420,6 +3571,7 @@ const char *kmap(KeySym k, uint state) {
 void cresize(int width, int height) {
   int col, row;
 
+  xlock();
   if (width != 0)
     win.w = width;
   if (height != 0)
@@ -2430,11 +3582,12 @@ void cresize(int width, int height) {
 
   tresize(col, row);
   xresize(col, row);
+  xunlock();
 }
 
 void usage(void) {
-  die("usage: %s [-aiv] [-c class] [-f font] [-g geometry]"
-      " [-n name] [-o file]\n"
+  die("usage: %s [-aiSv] [-c class] [-f font] [-g geometry]"
+      " [-L file] [-n name] [-o file]\n"
       "          [-T title] [-t title] [-w windowid]"
       " [[-e] command [args ...]]\n",
       argv0);
@@ -2,6 +2,7 @@
 #define MT_MT_H
 
 #include <cstddef>
+#include <cstdlib>
 #include <cstdint>
 #include <ctime>
 
@@ -42,6 +43,7 @@ enum glyph_attribute {
   ATTR_WRAP       = 1 << 8,
   ATTR_WIDE       = 1 << 9,
   ATTR_WDUMMY     = 1 << 10,
+  ATTR_PROTECTED  = 1 << 11, /* DECSCA, kept by selective erase */
   ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
 };
 
@@ -69,6 +71,8 @@ enum term_mode {
   MODE_PRINT       = 1 << 20,
   MODE_UTF8        = 1 << 21,
   MODE_SIXEL       = 1 << 22,
+  MODE_SYNC        = 1 << 23,
+  MODE_LRMARGIN    = 1 << 24,
   MODE_MOUSE       = MODE_MOUSEBTN | MODE_MOUSEMOTION | MODE_MOUSEX10 |
                      MODE_MOUSEMANY,
 };
@@ -111,10 +115,11 @@ typedef struct {
   Line *line;             /* screen */
   Line *alt;              /* alternate screen */
   int *dirty;             /* dirtyness of lines */
-  XftGlyphFontSpec *specbuf; /* font spec buffer used for rendering */
   TCursor c;              /* cursor */
   int top;                /* top    scroll limit */
   int bot;                /* bottom scroll limit */
+  int left;               /* left   scroll limit, with DECLRMM */
+  int right;              /* right  scroll limit, with DECLRMM */
   int mode;               /* terminal mode flags */
   int esc;                /* escape state flags */
   char trantbl[4];        /* charset table translation */
@@ -122,6 +127,8 @@ typedef struct {
   int icharset;           /* selected charset for sequence */
   int numlock;            /* lock numbers in keyboard */
   int *tabs;
+  struct timespec synced; /* when MODE_SYNC was set */
+  Rune lastc;             /* last printed char, for REP */
 } Term;
 
 /* Purely graphic info */
@@ -191,10 +198,18 @@ void tsetdirt(int, int);
 void tsetdirtattr(int);
 int match(uint, uint);
 void ttynew(void);
-size_t ttyread(void);
+int ttystartreader(void);
+size_t ttyread(long);
+int ttypending(void);
+void ttyreport(void);
+long tsynchold(void);
+void ttyreap(int);
+int ttyissignal(const char *, size_t);
 void ttyresize(void);
 void ttysend(const char *, size_t);
 void ttywrite(const char *, size_t);
+void ttyreply(const char *, size_t);
+size_t ttyflush(void);
 
 void resettitle(void);
 
@@ -214,6 +229,22 @@ size_t utf8encode(Rune, char *);
 
 char *xstrdup(char *);
 
+template <typename T> T *xmalloc(size_t len) {
+  void *p = malloc(len * sizeof(T));
+
+  if (!p)
+    die("Out of memory\n");
+
+  return static_cast<T *>(p);
+}
+
+template <typename T> T *xrealloc(void *p, size_t len) {
+  if ((p = realloc(p, len * sizeof(T))) == NULL)
+    die("Out of memory\n");
+
+  return static_cast<T *>(p);
+}
+
 void usage(void);
 
 /* Globals */
@@ -227,8 +258,10 @@ extern char *opt_class;
 extern char *opt_embed;
 extern char *opt_font;
 extern char *opt_io;
+extern char *opt_log;
 extern char *opt_name;
 extern char *opt_title;
+extern int opt_stats;
 extern int oldbutton;
 
 extern char *usedfont;
@@ -245,8 +278,16 @@ extern unsigned int tripleclicktimeout;
 extern int allowaltscreen;
 extern unsigned int xfps;
 extern unsigned int actionfps;
+extern unsigned int unfocusedfps;
+extern unsigned int interactivetimeout;
+extern unsigned int parseslice;
+extern unsigned int floodfps;
+extern unsigned int echowindow;
 extern unsigned int cursorthickness;
 extern unsigned int blinktimeout;
+extern unsigned int fontsetcachesize;
+extern Rune warmupranges[][2];
+extern size_t warmuprangeslen;
 extern char termname[];
 extern const char *colorname[];
 extern size_t colornamelen;
@@ -7,6 +7,7 @@
 #include <cmath>
 #include <csignal>
 #include <cstdint>
+#include <cstring>
 #include <ctime>
 
 extern "C" {
@@ -16,13 +17,17 @@ extern "C" {
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/cursorfont.h>
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
 #include <X11/keysym.h>
 #include <libgen.h>
-#include <sys/select.h>
+#include <pthread.h>
 #include <unistd.h>
 }
 
 #include "arg.h"
+#include "event.h"
 #include "mt.h"
 
 /* XEMBED messages */
@@ -53,11 +58,12 @@ typedef struct {
   int isfixed; /* is fixed geometry? */
   int l, t;    /* left and top offset */
   int gm;      /* geometry mask */
+  int rrevent; /* RandR event base, -1 without RandR */
 } XWindow;
 
 typedef struct { Atom xtarget; } XSelection;
 
-/* MTFont structure */
+/* MTFont structure, match is NULL until a deferred face is first used */
 typedef struct {
   int height;
   int width;
@@ -90,7 +96,16 @@ static void xclear(int, int, int, int);
 static void xdrawcursor(void);
 static int xgeommasktogravity(int);
 static int xloadfont(MTFont *, FcPattern *);
+static void xdeferfont(MTFont *, FcPattern *);
+static MTFont *xface(MTFont *);
 static void xunloadfont(MTFont *);
+static XftFont *xfindfont(MTFont *, int, Rune, FT_UInt *, int);
+static void xwarmupreset(void);
+static int xwarming(void);
+static void xwarmup(long);
+static void xstartrenderer(void);
+static void *xrenderer(void *);
+static void xtakeframe(void);
 
 static void expose(XEvent *);
 static void visibility(XEvent *);
@@ -104,12 +119,23 @@ static void bpress(XEvent *);
 static void bmotion(XEvent *);
 static void propnotify(XEvent *);
 static void selnotify(XEvent *);
+static void xpasteappend(const char *, size_t);
+static void xpastefeed(void);
+static void xpasteincrend(void);
+static void xkeysend(const char *, size_t);
 static void selclear_(XEvent *);
 static void selrequest(XEvent *);
 
 static void selcopy(Time);
 static void getbuttoninfo(XEvent *);
 static void mousereport(XEvent *);
+static void startupreport(void);
+#ifdef HAVE_XRANDR
+static double xrefreshrate(void);
+#endif
+static void xpaceinit(void);
+static void xscreenchange(XEvent *);
+static int64_t xframeinterval(int, struct timespec);
 
 void handle(XEvent *ev) {
   switch (ev->type) {
@@ -146,6 +172,8 @@ void handle(XEvent *ev) {
     return propnotify(ev);
   case SelectionRequest:
     return selrequest(ev);
+  default:
+    return xscreenchange(ev);
   }
 }
 
@@ -167,6 +195,120 @@ typedef struct {
 static Fontcache frc[16];
 static int frclen = 0;
 
+/*
+ * Glyph warm-up position. Range 0 is printable ASCII, range i > 0 is
+ * warmupranges[i - 1]; within each range every face is visited in turn.
+ */
+typedef struct {
+  size_t range;
+  int face;
+  Rune next;
+} Warmup;
+
+static Warmup warm;
+/* Deferred faces are only loaded by the warm-up once the first frame is up. */
+static int warmfaces;
+
+/* Startup milestones, reported with -S to track time to first prompt. */
+static struct {
+  struct timespec start, tty, xinit, mapped, output, frame;
+} startup;
+
+#define TSNS(t) ((int64_t)(t).tv_sec * 1000000000 + (t).tv_nsec)
+
+/*
+ * Frame pacing. Frames are spaced by whole display refreshes: every one while
+ * interacting, fewer for program output or an unfocused window, none while
+ * the window can't be seen. Each deadline follows from the previous deadline
+ * rather than from when that frame was drawn, so the spacing doesn't drift.
+ */
+static struct {
+  int64_t period;        /* ns per display refresh */
+  int64_t next;          /* deadline of the next frame, ns */
+  struct timespec input; /* last X event */
+  XRectangle crtc;       /* monitor period is for, 0 wide if unknown */
+} pace;
+
+/* The last key sent to the child, whose echo is drawn as soon as it's in. */
+static struct timespec keysent;
+static int echopending;
+
+/*
+ * Paste data not yet handed to the tty. It is fed to the write queue in
+ * pieces as the pty accepts them, so long pastes don't stall the event loop.
+ */
+static struct {
+  char *buf;
+  size_t off, len, cap;
+  int active;  /* between the first data and the end of the transfer */
+  int incr;    /* INCR transfer with more chunks to come */
+  Atom held;   /* INCR property left undeleted until the paste drains */
+  int bracket; /* the opening bracket went out, the closing one must too */
+  char *keys;  /* key input held back until the paste is out */
+  size_t keyslen, keyscap;
+  size_t sent, total;
+  struct timespec start, reported, last; /* last: latest INCR chunk */
+} paste;
+
+/* Most paste bytes in the tty write queue at once. */
+static const size_t pastequeue = 1 << 16;
+/* Size of a single selection property read, in 32-bit units. */
+static const long pastereadlen = 1 << 18;
+/* An INCR transfer without a new chunk for this long is given up, in ms. */
+static const long pasteincrtimeout = 2000;
+
+/* Time slice for glyph warm-up while the event loop is idle, in ms. */
+static const long warmupslice = 5;
+
+/*
+ * Fonts of recently used sizes, kept loaded along with their fallback cache
+ * so that zooming back to one of them needs no fontconfig calls.
+ */
+typedef struct {
+  double size; /* 0 for an empty slot */
+  unsigned long used;
+  MTFont font, bfont, ifont, ibfont;
+  Fontcache cache[LEN(frc)];
+  int cachelen;
+  Warmup warm;
+} FontSet;
+
+static FontSet *fontsets;
+static unsigned long fontsetclock;
+
+/*
+ * Terminal state as of the last draw(). The main thread publishes dirty rows
+ * into `published'; the render thread moves them into its private `view' and
+ * draws from there while parsing goes on. Selection is already applied to
+ * the rows as ATTR_REVERSE.
+ */
+typedef struct {
+  int row, col;
+  Line *line;
+  int *dirty;
+  XftGlyphFontSpec *specbuf; /* render thread only */
+  TCursor c;
+  int cursel; /* cursor cell is selected */
+  int mode;   /* term.mode */
+  char state; /* win.state */
+  int cursor; /* win.cursor */
+} Frame;
+
+static Frame published, view;
+static int framepending;
+static pthread_mutex_t framelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t framecond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Held by the render thread while drawing, and by the main thread while it
+ * changes fonts, colors, the pixmap or the window geometry. Taken before
+ * framelock when both are needed.
+ */
+static pthread_mutex_t drawlock;
+
+static void xunloadfontset(FontSet *);
+static int xrestorefonts(double);
+
 void getbuttoninfo(XEvent *e) {
   int type;
   uint state = e->xbutton.state & ~(Button1Mask | forceselmod);
@@ -242,7 +384,7 @@ void mousereport(XEvent *e) {
     return;
   }
 
-  ttywrite(buf, len);
+  ttyreply(buf, len);
 }
 
 void bpress(XEvent *e) {
@@ -308,13 +450,16 @@ void propnotify(XEvent *e) {
 void selnotify(XEvent *e) {
   ulong nitems, ofs, rem;
   int format;
-  uchar *data, *last;
+  uchar *data;
   Atom type, incratom, property;
 
   incratom = XInternAtom(xw.dpy, "INCR", 0);
 
   ofs = 0;
   if (e->type == SelectionNotify) {
+    /* A new transfer; an INCR one still going was abandoned by its owner. */
+    if (paste.incr)
+      xpasteincrend();
     property = e->xselection.property;
   } else if (e->type == PropertyNotify) {
     property = e->xproperty.atom;
@@ -325,10 +470,13 @@ void selnotify(XEvent *e) {
     return;
 
   do {
-    if (XGetWindowProperty(xw.dpy, xw.win, property, ofs, BUFSIZ / 4, False,
+    if (XGetWindowProperty(xw.dpy, xw.win, property, ofs, pastereadlen, False,
                            AnyPropertyType, &type, &format, &nitems, &rem,
                            &data)) {
       fprintf(stderr, "Clipboard allocation failed\n");
+      if (paste.incr)
+        xpasteincrend();
+      xpastefeed();
       return;
     }
 
@@ -339,8 +487,7 @@ void selnotify(XEvent *e) {
        * data has been transferred. We won't need to receive
        * PropertyNotify events anymore.
        */
-      MODBIT(xw.attrs.event_mask, 0, PropertyChangeMask);
-      XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask, &xw.attrs);
+      xpasteincrend();
     }
 
     if (type == incratom) {
@@ -351,39 +498,165 @@ void selnotify(XEvent *e) {
        */
       MODBIT(xw.attrs.event_mask, 1, PropertyChangeMask);
       XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask, &xw.attrs);
+      paste.incr = 1;
+      clock_gettime(CLOCK_MONOTONIC, &paste.last);
 
       /*
        * Deleting the property is the transfer start signal.
        */
+      XFree(data);
       XDeleteProperty(xw.dpy, xw.win, (int)property);
       continue;
     }
 
-    /*
-     * As seen in getsel:
-     * Line endings are inconsistent in the terminal and GUI world
-     * copy and pasting. When receiving some selection data,
-     * replace all '\n' with '\r'.
-     * FIXME: Fix the computer world.
-     */
-    last = data + nitems * format / 8;
-    std::replace(data, last, '\n', '\r');
-
-    if (IS_SET(MODE_BRCKTPASTE) && ofs == 0)
-      ttywrite("\033[200~", 6);
-    ttysend((char *)data, nitems * format / 8);
-    if (IS_SET(MODE_BRCKTPASTE) && rem == 0)
-      ttywrite("\033[201~", 6);
+    xpasteappend((char *)data, nitems * format / 8);
     XFree(data);
     /* number of 32-bit chunks returned */
     ofs += nitems * format / 32;
   } while (rem > 0);
+  if (paste.incr)
+    clock_gettime(CLOCK_MONOTONIC, &paste.last);
 
   /*
    * Deleting the property again tells the selection owner to send the
-   * next data chunk in the property.
+   * next data chunk in the property. While more than the tty queue's worth
+   * is still waiting, xpastefeed() asks for it once the pty took enough.
+   */
+  if (paste.incr && paste.len - paste.off > pastequeue)
+    paste.held = property;
+  else
+    XDeleteProperty(xw.dpy, xw.win, (int)property);
+  xpastefeed();
+}
+
+/* Adds received selection data to the paste, starting one if needed. */
+void xpasteappend(const char *s, size_t n) {
+  char *p, *end;
+
+  if (n == 0)
+    return;
+  if (!paste.active) {
+    paste.active = 1;
+    paste.sent = paste.total = 0;
+    clock_gettime(CLOCK_MONOTONIC, &paste.start);
+    paste.reported = paste.start;
+    if ((paste.bracket = IS_SET(MODE_BRCKTPASTE)))
+      ttywrite("\033[200~", 6);
+  }
+  if (paste.len + n > paste.cap) {
+    memmove(paste.buf, paste.buf + paste.off, paste.len - paste.off);
+    paste.len -= paste.off;
+    paste.off = 0;
+    if (paste.len + n > paste.cap) {
+      paste.cap = MAX(2 * paste.cap, paste.len + n);
+      paste.buf = xrealloc<char>(paste.buf, paste.cap);
+    }
+  }
+  p = paste.buf + paste.len;
+  memcpy(p, s, n);
+  paste.len += n;
+  paste.total += n;
+
+  /*
+   * As seen in getsel:
+   * Line endings are inconsistent in the terminal and GUI world
+   * copy and pasting. When receiving some selection data,
+   * replace all '\n' with '\r'.
+   * FIXME: Fix the computer world.
    */
-  XDeleteProperty(xw.dpy, xw.win, (int)property);
+  for (end = p + n; (p = static_cast<char *>(memchr(p, '\n', end - p)));)
+    *p++ = '\r';
+}
+
+/* Stops listening for INCR chunks, the paste ends once it is out. */
+void xpasteincrend(void) {
+  MODBIT(xw.attrs.event_mask, 0, PropertyChangeMask);
+  XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask, &xw.attrs);
+  paste.incr = 0;
+  paste.held = None;
+}
+
+/*
+ * Sends key input to the tty. During a paste it waits until the paste is out,
+ * so that it can't land inside it. Interrupt, quit and suspend drop the rest
+ * of the paste and go out right away.
+ */
+void xkeysend(const char *s, size_t n) {
+  if (!paste.active) {
+    ttysend(s, n);
+    return;
+  }
+  if (ttyissignal(s, n)) {
+    paste.off = paste.len = 0;
+    if (paste.incr)
+      xpasteincrend();
+    xpastefeed();
+    ttysend(s, n);
+    return;
+  }
+  if (paste.keyslen + n > paste.keyscap) {
+    paste.keyscap = MAX(2 * paste.keyscap, paste.keyslen + n);
+    paste.keys = xrealloc<char>(paste.keys, paste.keyscap);
+  }
+  memcpy(paste.keys + paste.keyslen, s, n);
+  paste.keyslen += n;
+}
+
+/*
+ * Hands paste data to the tty while its write queue is short, and closes the
+ * bracket once everything went out. Called whenever the queue may have
+ * drained.
+ */
+void xpastefeed(void) {
+  struct timespec now;
+  size_t n, queued;
+
+  if (!paste.active && !paste.incr)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (paste.incr && paste.held == None &&
+      TIMEDIFF(now, paste.last) >= pasteincrtimeout) {
+    fprintf(stderr, "mt: paste: INCR transfer stalled, giving up\n");
+    xpasteincrend();
+  }
+  if (!paste.active)
+    return;
+  while (paste.off < paste.len && (queued = ttyflush()) < pastequeue) {
+    n = MIN(paste.len - paste.off, pastequeue - queued);
+    /* Don't split a UTF-8 sequence, for the sake of local echo. */
+    while (n > 1 && paste.off + n < paste.len &&
+           (paste.buf[paste.off + n] & 0xc0) == 0x80)
+      n--;
+    ttysend(paste.buf + paste.off, n);
+    paste.off += n;
+    paste.sent += n;
+  }
+  /* Ask for the next INCR chunk once the buffer ran low. */
+  if (paste.held != None && paste.len - paste.off <= pastequeue) {
+    XDeleteProperty(xw.dpy, xw.win, (int)paste.held);
+    XFlush(xw.dpy);
+    paste.held = None;
+    paste.last = now;
+  }
+
+  if (paste.off == paste.len) {
+    paste.off = paste.len = 0;
+    if (paste.incr)
+      return;
+    if (paste.bracket)
+      ttywrite("\033[201~", 6);
+    paste.active = 0;
+    if (paste.keyslen) {
+      ttysend(paste.keys, paste.keyslen);
+      paste.keyslen = 0;
+    }
+    if (opt_stats)
+      fprintf(stderr, "mt: paste: %zu bytes in %ld ms\n", paste.total,
+              (long)TIMEDIFF(now, paste.start));
+  } else if (opt_stats && TIMEDIFF(now, paste.reported) >= 1000) {
+    fprintf(stderr, "mt: paste: %zu of %zu bytes\n", paste.sent, paste.total);
+    paste.reported = now;
+  }
 }
 
 void xselpaste(void) {
@@ -496,6 +769,7 @@ void brelease(XEvent *e) {
 
 void bmotion(XEvent *e) {
   int oldey, oldex, oldsby, oldsey;
+  static uint oldstate;
 
   if (IS_SET(MODE_MOUSE) && !(e->xbutton.state & forceselmod)) {
     mousereport(e);
@@ -505,6 +779,12 @@ void bmotion(XEvent *e) {
   if (!sel.mode)
     return;
 
+  /* Within the same cell the selection can't change. */
+  if (sel.mode == SEL_READY && e->xbutton.state == oldstate &&
+      x2col(e->xbutton.x) == sel.oe.x && y2row(e->xbutton.y) == sel.oe.y)
+    return;
+  oldstate = e->xbutton.state;
+
   sel.mode = SEL_READY;
   oldey = sel.oe.y;
   oldex = sel.oe.x;
@@ -556,6 +836,7 @@ void xloadcols(void) {
   static int loaded;
   Color *cp;
 
+  xlock();
   dc.collen = MAX(colornamelen, 256);
   dc.col = static_cast<Color *>(malloc(dc.collen * sizeof(Color)));
   if (!dc.col)
@@ -574,6 +855,7 @@ void xloadcols(void) {
         die("Could not allocate color %d\n", i);
     }
   loaded = 1;
+  xunlock();
 }
 
 int xsetcolorname(int x, const char *name) {
@@ -582,11 +864,15 @@ int xsetcolorname(int x, const char *name) {
   if (!BETWEEN(x, 0, dc.collen))
     return 1;
 
-  if (!xloadcolor(x, name, &ncolor))
+  xlock();
+  if (!xloadcolor(x, name, &ncolor)) {
+    xunlock();
     return 1;
+  }
 
   XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[x]);
   dc.col[x] = ncolor;
+  xunlock();
 
   return 0;
 }
@@ -595,7 +881,8 @@ int xsetcolorname(int x, const char *name) {
  * Absolute coordinates.
  */
 void xclear(int x1, int y1, int x2, int y2) {
-  XftDrawRect(xw.draw, &dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg],
+  XftDrawRect(xw.draw,
+              &dc.col[(view.mode & MODE_REVERSE) ? defaultfg : defaultbg],
               x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -735,6 +1022,11 @@ void xloadfonts(const char *fontstr, double fontsize) {
   if (!pattern)
     die("mt: can't open font %s\n", fontstr);
 
+  if (fontsize > 1 && xrestorefonts(fontsize)) {
+    FcPatternDestroy(pattern);
+    return;
+  }
+
   if (fontsize > 1) {
     FcPatternDel(pattern, FC_PIXEL_SIZE);
     FcPatternDel(pattern, FC_SIZE);
@@ -772,73 +1064,226 @@ void xloadfonts(const char *fontstr, double fontsize) {
   win.cw = ceilf(dc.font.width * cwscale);
   win.ch = ceilf(dc.font.height * chscale);
 
+  /*
+   * The other faces are matched when first needed, by a run using them or
+   * by the glyph warm-up after the first frame, to keep them off the startup
+   * path.
+   */
   FcPatternDel(pattern, FC_SLANT);
   FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-  if (xloadfont(&dc.ifont, pattern))
-    die("mt: can't open font %s\n", fontstr);
+  xdeferfont(&dc.ifont, pattern);
 
   FcPatternDel(pattern, FC_WEIGHT);
   FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-  if (xloadfont(&dc.ibfont, pattern))
-    die("mt: can't open font %s\n", fontstr);
+  xdeferfont(&dc.ibfont, pattern);
 
   FcPatternDel(pattern, FC_SLANT);
   FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
-  if (xloadfont(&dc.bfont, pattern))
-    die("mt: can't open font %s\n", fontstr);
+  xdeferfont(&dc.bfont, pattern);
 
   FcPatternDestroy(pattern);
+  xwarmupreset();
+}
+
+void xdeferfont(MTFont *f, FcPattern *pattern) {
+  memset(f, 0, sizeof(*f));
+  if (!(f->pattern = FcPatternDuplicate(pattern)))
+    die("Out of memory\n");
+}
+
+/* Returns the face, loading it first if it was deferred. */
+MTFont *xface(MTFont *f) {
+  FcPattern *pattern;
+
+  if (!f->match) {
+    pattern = f->pattern;
+    if (xloadfont(f, pattern))
+      die("mt: can't open font %s\n", usedfont);
+    FcPatternDestroy(pattern);
+  }
+
+  return f;
 }
 
 void xunloadfont(MTFont *f) {
-  XftFontClose(xw.dpy, f->match);
+  if (f->match)
+    XftFontClose(xw.dpy, f->match);
   FcPatternDestroy(f->pattern);
   if (f->set)
     FcFontSetDestroy(f->set);
 }
 
-void xunloadfonts(void) {
+void xunloadfontset(FontSet *fs) {
   /* Free the loaded fonts in the font cache.  */
-  while (frclen > 0)
-    XftFontClose(xw.dpy, frc[--frclen].font);
+  while (fs->cachelen > 0)
+    XftFontClose(xw.dpy, fs->cache[--fs->cachelen].font);
+
+  xunloadfont(&fs->font);
+  xunloadfont(&fs->bfont);
+  xunloadfont(&fs->ifont);
+  xunloadfont(&fs->ibfont);
+  fs->size = 0;
+}
+
+/*
+ * Put the current fonts aside in the least recently used slot, unloading
+ * whatever was there before. The current size counts against
+ * fontsetcachesize, so fontsetcachesize - 1 sizes are put aside.
+ */
+void xunloadfonts(void) {
+  FontSet *fs, cur;
+  uint i;
+
+  cur.size = usedfontsize;
+  cur.used = ++fontsetclock;
+  cur.font = dc.font;
+  cur.bfont = dc.bfont;
+  cur.ifont = dc.ifont;
+  cur.ibfont = dc.ibfont;
+  memcpy(cur.cache, frc, sizeof(frc));
+  cur.cachelen = frclen;
+  cur.warm = warm;
+  frclen = 0;
+
+  if (fontsetcachesize <= 1) {
+    xunloadfontset(&cur);
+    return;
+  }
+  if (!fontsets &&
+      !(fontsets = (FontSet *)calloc(fontsetcachesize - 1, sizeof(FontSet))))
+    die("Out of memory\n");
+
+  for (fs = &fontsets[0], i = 1; i < fontsetcachesize - 1; i++) {
+    if (!fs->size)
+      break;
+    if (!fontsets[i].size || fontsets[i].used < fs->used)
+      fs = &fontsets[i];
+  }
+  if (fs->size)
+    xunloadfontset(fs);
+  *fs = cur;
+}
+
+/* Make the cached fonts for `size` current again, if there are any. */
+int xrestorefonts(double size) {
+  FontSet *fs;
+  uint i;
 
-  xunloadfont(&dc.font);
-  xunloadfont(&dc.bfont);
-  xunloadfont(&dc.ifont);
-  xunloadfont(&dc.ibfont);
+  for (i = 0; fontsets && i < fontsetcachesize - 1; i++) {
+    fs = &fontsets[i];
+    if (fs->size != size)
+      continue;
+
+    dc.font = fs->font;
+    dc.bfont = fs->bfont;
+    dc.ifont = fs->ifont;
+    dc.ibfont = fs->ibfont;
+    memcpy(frc, fs->cache, sizeof(frc));
+    frclen = fs->cachelen;
+    warm = fs->warm;
+    fs->size = 0;
+
+    usedfontsize = size;
+    win.cw = ceilf(dc.font.width * cwscale);
+    win.ch = ceilf(dc.font.height * chscale);
+    return 1;
+  }
+
+  return 0;
 }
 
-void xinit(void) {
-  XGCValues gcvalues;
-  Cursor cursor;
+void xwarmupreset(void) {
+  warm.range = 0;
+  warm.face = 0;
+  warm.next = 0;
+}
+
+/* Faces in the order the warm-up visits them. */
+static MTFont *const warmupfaces[] = {&dc.font, &dc.bfont, &dc.ifont,
+                                      &dc.ibfont};
+
+int xwarming(void) {
+  return warm.range <= warmuprangeslen &&
+         (warmfaces || warmupfaces[warm.face]->match);
+}
+
+/*
+ * Resolve and upload glyphs for code points that are likely to be drawn, so
+ * the first frames after loading fonts don't pay for it. Works for roughly
+ * `budget` ms at a time. Before the first frame it stops at the first face
+ * that isn't loaded yet.
+ */
+void xwarmup(long budget) {
+  static const Rune ascii[2] = {0x20, 0x7e};
+  MTFont *const *faces = warmupfaces;
+  int flags[] = {FRC_NORMAL, FRC_BOLD, FRC_ITALIC, FRC_ITALICBOLD};
+  struct timespec start, now;
+  const Rune *range;
+  XftFont *xfont;
+  FT_UInt glyphidx;
+  int n;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  xlock();
+  for (n = 1; xwarming(); n++) {
+    range = warm.range ? warmupranges[warm.range - 1] : ascii;
+    if (warm.next < range[0])
+      warm.next = range[0];
+    if (warm.next > range[1]) {
+      warm.next = 0;
+      if (++warm.face == LEN(warmupfaces)) {
+        warm.face = 0;
+        warm.range++;
+      }
+      continue;
+    }
+
+    xfont = xfindfont(xface(faces[warm.face]), flags[warm.face], warm.next++,
+                      &glyphidx, 0);
+    if (xfont && glyphidx)
+      XftFontLoadGlyphs(xw.dpy, xfont, FcTrue, &glyphidx, 1);
+    else
+      /* No font has it, the rest of the range likely isn't covered either. */
+      warm.next = range[1] + 1;
+
+    if (n % 16 == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (TIMEDIFF(now, start) >= budget)
+        break;
+    }
+  }
+  xunlock();
+}
+
+/*
+ * Connects to the display and creates the (still unmapped) window, which is
+ * all the shell needs (for $WINDOWID) before it can be started.
+ */
+void xopen(void) {
   Window parent;
-  pid_t thispid = getpid();
-  XColor xmousefg, xmousebg;
+  pthread_mutexattr_t attr;
+#ifdef HAVE_XRANDR
+  int err;
+#endif
+
+  /* Drawing happens on its own thread, see xrenderer(). */
+  if (!XInitThreads())
+    die("XInitThreads failed\n");
+  /* Zooming resizes the window while already holding the lock. */
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&drawlock, &attr);
+  pthread_mutexattr_destroy(&attr);
 
   if (!(xw.dpy = XOpenDisplay(NULL)))
     die("Can't open display\n");
   xw.scr = XDefaultScreen(xw.dpy);
   xw.vis = XDefaultVisual(xw.dpy, xw.scr);
 
-  /* font */
-  if (!FcInit())
-    die("Could not init fontconfig.\n");
-
-  usedfont = (opt_font == NULL) ? font : opt_font;
-  xloadfonts(usedfont, 0);
-
   /* colors */
   xw.cmap = XDefaultColormap(xw.dpy, xw.scr);
   xloadcols();
 
-  /* adjust fixed window geometry */
-  win.w = 2 * borderpx + term.col * win.cw;
-  win.h = 2 * borderpx + term.row * win.ch;
-  if (xw.gm & XNegative)
-    xw.l += DisplayWidth(xw.dpy, xw.scr) - win.w - 2;
-  if (xw.gm & YNegative)
-    xw.t += DisplayHeight(xw.dpy, xw.scr) - win.h - 2;
-
   /* Events */
   xw.attrs.background_pixel = dc.col[defaultbg].pixel;
   xw.attrs.border_pixel = dc.col[defaultbg].pixel;
@@ -848,17 +1293,50 @@ void xinit(void) {
                         ButtonMotionMask | ButtonPressMask | ButtonReleaseMask;
   xw.attrs.colormap = xw.cmap;
 
+  /* The real size is only known once the fonts are loaded by xinit(). */
   if (!(opt_embed && (parent = strtol(opt_embed, NULL, 0))))
     parent = XRootWindow(xw.dpy, xw.scr);
-  xw.win = XCreateWindow(xw.dpy, parent, xw.l, xw.t, win.w, win.h, 0,
+  xw.win = XCreateWindow(xw.dpy, parent, xw.l, xw.t, 1, 1, 0,
                          XDefaultDepth(xw.dpy, xw.scr), InputOutput, xw.vis,
                          CWBackPixel | CWBorderPixel | CWBitGravity |
                              CWEventMask | CWColormap,
                          &xw.attrs);
 
+  xw.rrevent = -1;
+#ifdef HAVE_XRANDR
+  /* Mode and layout changes can change the refresh rate under the window. */
+  if (XRRQueryExtension(xw.dpy, &xw.rrevent, &err))
+    XRRSelectInput(xw.dpy, xw.win, RRScreenChangeNotifyMask);
+  else
+    xw.rrevent = -1;
+#endif
+}
+
+void xinit(void) {
+  XGCValues gcvalues;
+  Cursor cursor;
+  pid_t thispid = getpid();
+  XColor xmousefg, xmousebg;
+
+  /* font */
+  if (!FcInit())
+    die("Could not init fontconfig.\n");
+
+  usedfont = (opt_font == NULL) ? font : opt_font;
+  xloadfonts(usedfont, 0);
+
+  /* adjust fixed window geometry */
+  win.w = 2 * borderpx + term.col * win.cw;
+  win.h = 2 * borderpx + term.row * win.ch;
+  if (xw.gm & XNegative)
+    xw.l += DisplayWidth(xw.dpy, xw.scr) - win.w - 2;
+  if (xw.gm & YNegative)
+    xw.t += DisplayHeight(xw.dpy, xw.scr) - win.h - 2;
+  XMoveResizeWindow(xw.dpy, xw.win, xw.l, xw.t, win.w, win.h);
+
   memset(&gcvalues, 0, sizeof(gcvalues));
   gcvalues.graphics_exposures = False;
-  dc.gc = XCreateGC(xw.dpy, parent, GCGraphicsExposures, &gcvalues);
+  dc.gc = XCreateGC(xw.dpy, xw.win, GCGraphicsExposures, &gcvalues);
   xw.buf =
       XCreatePixmap(xw.dpy, xw.win, win.w, win.h, DefaultDepth(xw.dpy, xw.scr));
   XSetForeground(xw.dpy, dc.gc, dc.col[defaultbg].pixel);
@@ -920,6 +1398,92 @@ void xinit(void) {
     xsel.xtarget = XA_STRING;
 }
 
+XftFont *xfindfont(MTFont *font, int frcflags, Rune rune, FT_UInt *glyphidx,
+                   int cachemiss) {
+  FcResult fcres;
+  FcPattern *fcpattern, *fontpattern;
+  FcFontSet *fcsets[] = {NULL};
+  FcCharSet *fccharset;
+  XftFont *match;
+  int f;
+
+  /* Lookup character index with default font. */
+  if ((*glyphidx = XftCharIndex(xw.dpy, font->match, rune)))
+    return font->match;
+
+  /* Fallback on font cache, search the font cache for match. */
+  for (f = 0; f < frclen; f++) {
+    *glyphidx = XftCharIndex(xw.dpy, frc[f].font, rune);
+    /* Everything correct. */
+    if (*glyphidx && frc[f].flags == frcflags)
+      return frc[f].font;
+    /* We got a default font for a not found glyph. */
+    if (!*glyphidx && frc[f].flags == frcflags && frc[f].unicodep == rune)
+      return frc[f].font;
+  }
+
+  /*
+   * Speculative lookups (glyph warm-up) only fill free cache slots, the last
+   * one is evicted for fallbacks that are actually drawn.
+   */
+  if (!cachemiss && frclen >= LEN(frc) - 1)
+    return NULL;
+
+  /* Nothing was found. Use fontconfig to find matching font. */
+  if (!font->set)
+    font->set = FcFontSort(0, font->pattern, 1, 0, &fcres);
+  fcsets[0] = font->set;
+
+  /*
+   * Nothing was found in the cache. Now use
+   * some dozen of Fontconfig calls to get the
+   * font for one single character.
+   *
+   * Xft and fontconfig are design failures.
+   */
+  fcpattern = FcPatternDuplicate(font->pattern);
+  fccharset = FcCharSetCreate();
+
+  FcCharSetAddChar(fccharset, rune);
+  FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+  FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
+
+  FcConfigSubstitute(0, fcpattern, FcMatchPattern);
+  FcDefaultSubstitute(fcpattern);
+
+  fontpattern = FcFontSetMatch(0, fcsets, 1, fcpattern, &fcres);
+  match = XftFontOpenPattern(xw.dpy, fontpattern);
+  *glyphidx = XftCharIndex(xw.dpy, match, rune);
+
+  FcPatternDestroy(fcpattern);
+  FcCharSetDestroy(fccharset);
+
+  /*
+   * Callers that are only speculating (glyph warm-up) don't want the
+   * cache filled with fonts that can't render the rune anyway.
+   */
+  if (!*glyphidx && !cachemiss) {
+    XftFontClose(xw.dpy, match);
+    return NULL;
+  }
+
+  /*
+   * Overwrite or create the new cache entry.
+   */
+  if (frclen >= LEN(frc)) {
+    frclen = LEN(frc) - 1;
+    XftFontClose(xw.dpy, frc[frclen].font);
+    frc[frclen].unicodep = 0;
+  }
+
+  frc[frclen].font = match;
+  frc[frclen].flags = frcflags;
+  frc[frclen].unicodep = rune;
+  frclen++;
+
+  return match;
+}
+
 int xmakeglyphfontspecs(XftGlyphFontSpec *specs, const MTGlyph *glyphs, int len,
                         int x, int y) {
   float winx = borderpx + x * win.cw, winy = borderpx + y * win.ch, xp, yp;
@@ -929,11 +1493,7 @@ int xmakeglyphfontspecs(XftGlyphFontSpec *specs, const MTGlyph *glyphs, int len,
   float runewidth = win.cw;
   Rune rune;
   FT_UInt glyphidx;
-  FcResult fcres;
-  FcPattern *fcpattern, *fontpattern;
-  FcFontSet *fcsets[] = {NULL};
-  FcCharSet *fccharset;
-  int i, f, numspecs = 0;
+  int i, numspecs = 0;
 
   for (i = 0, xp = winx, yp = winy + font->ascent; i < len; ++i) {
     /* Fetch rune and mode for current glyph. */
@@ -951,90 +1511,19 @@ int xmakeglyphfontspecs(XftGlyphFontSpec *specs, const MTGlyph *glyphs, int len,
       frcflags = FRC_NORMAL;
       runewidth = win.cw * ((mode & ATTR_WIDE) ? 2.0f : 1.0f);
       if ((mode & ATTR_ITALIC) && (mode & ATTR_BOLD)) {
-        font = &dc.ibfont;
+        font = xface(&dc.ibfont);
         frcflags = FRC_ITALICBOLD;
       } else if (mode & ATTR_ITALIC) {
-        font = &dc.ifont;
+        font = xface(&dc.ifont);
         frcflags = FRC_ITALIC;
       } else if (mode & ATTR_BOLD) {
-        font = &dc.bfont;
+        font = xface(&dc.bfont);
         frcflags = FRC_BOLD;
       }
       yp = winy + font->ascent;
     }
 
-    /* Lookup character index with default font. */
-    glyphidx = XftCharIndex(xw.dpy, font->match, rune);
-    if (glyphidx) {
-      specs[numspecs].font = font->match;
-      specs[numspecs].glyph = glyphidx;
-      specs[numspecs].x = (short)xp;
-      specs[numspecs].y = (short)yp;
-      xp += runewidth;
-      numspecs++;
-      continue;
-    }
-
-    /* Fallback on font cache, search the font cache for match. */
-    for (f = 0; f < frclen; f++) {
-      glyphidx = XftCharIndex(xw.dpy, frc[f].font, rune);
-      /* Everything correct. */
-      if (glyphidx && frc[f].flags == frcflags)
-        break;
-      /* We got a default font for a not found glyph. */
-      if (!glyphidx && frc[f].flags == frcflags && frc[f].unicodep == rune) {
-        break;
-      }
-    }
-
-    /* Nothing was found. Use fontconfig to find matching font. */
-    if (f >= frclen) {
-      if (!font->set)
-        font->set = FcFontSort(0, font->pattern, 1, 0, &fcres);
-      fcsets[0] = font->set;
-
-      /*
-       * Nothing was found in the cache. Now use
-       * some dozen of Fontconfig calls to get the
-       * font for one single character.
-       *
-       * Xft and fontconfig are design failures.
-       */
-      fcpattern = FcPatternDuplicate(font->pattern);
-      fccharset = FcCharSetCreate();
-
-      FcCharSetAddChar(fccharset, rune);
-      FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-      FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
-
-      FcConfigSubstitute(0, fcpattern, FcMatchPattern);
-      FcDefaultSubstitute(fcpattern);
-
-      fontpattern = FcFontSetMatch(0, fcsets, 1, fcpattern, &fcres);
-
-      /*
-       * Overwrite or create the new cache entry.
-       */
-      if (frclen >= LEN(frc)) {
-        frclen = LEN(frc) - 1;
-        XftFontClose(xw.dpy, frc[frclen].font);
-        frc[frclen].unicodep = 0;
-      }
-
-      frc[frclen].font = XftFontOpenPattern(xw.dpy, fontpattern);
-      frc[frclen].flags = frcflags;
-      frc[frclen].unicodep = rune;
-
-      glyphidx = XftCharIndex(xw.dpy, frc[frclen].font, rune);
-
-      f = frclen;
-      frclen++;
-
-      FcPatternDestroy(fcpattern);
-      FcCharSetDestroy(fccharset);
-    }
-
-    specs[numspecs].font = frc[f].font;
+    specs[numspecs].font = xfindfont(font, frcflags, rune, &glyphidx, 1);
     specs[numspecs].glyph = glyphidx;
     specs[numspecs].x = (short)xp;
     specs[numspecs].y = (short)yp;
@@ -1089,7 +1578,7 @@ void xdrawglyphfontspecs(const XftGlyphFontSpec *specs, MTGlyph base, int len,
   if ((base.mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(base.fg, 0, 7))
     fg = &dc.col[base.fg + 8];
 
-  if (IS_SET(MODE_REVERSE)) {
+  if (view.mode & MODE_REVERSE) {
     if (fg == &dc.col[defaultfg]) {
       fg = &dc.col[defaultbg];
     } else {
@@ -1127,7 +1616,7 @@ void xdrawglyphfontspecs(const XftGlyphFontSpec *specs, MTGlyph base, int len,
     fg = &revfg;
   }
 
-  if (base.mode & ATTR_BLINK && term.mode & MODE_BLINK)
+  if (base.mode & ATTR_BLINK && view.mode & MODE_BLINK)
     fg = bg;
 
   if (base.mode & ATTR_INVISIBLE)
@@ -1136,15 +1625,15 @@ void xdrawglyphfontspecs(const XftGlyphFontSpec *specs, MTGlyph base, int len,
   /* Intelligent cleaning up of the borders. */
   if (x == 0) {
     xclear(0, (y == 0) ? 0 : winy, borderpx,
-           winy + win.ch + ((y >= term.row - 1) ? win.h : 0));
+           winy + win.ch + ((y >= view.row - 1) ? win.h : 0));
   }
-  if (x + charlen >= term.col) {
+  if (x + charlen >= view.col) {
     xclear(winx + width, (y == 0) ? 0 : winy, win.w,
-           ((y >= term.row - 1) ? win.h : (winy + win.ch)));
+           ((y >= view.row - 1) ? win.h : (winy + win.ch)));
   }
   if (y == 0)
     xclear(winx, 0, winx + width, borderpx);
-  if (y == term.row - 1)
+  if (y == view.row - 1)
     xclear(winx, winy + win.ch, winx + width, win.h);
 
   /* Clean up the region we want to draw to. */
@@ -1185,37 +1674,34 @@ void xdrawcursor(void) {
   static int oldx = 0, oldy = 0;
   int curx;
   MTGlyph g = {' ', ATTR_NULL, defaultbg, defaultcs}, og;
-  int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
   Color drawcol;
 
-  LIMIT(oldx, 0, term.col - 1);
-  LIMIT(oldy, 0, term.row - 1);
+  LIMIT(oldx, 0, view.col - 1);
+  LIMIT(oldy, 0, view.row - 1);
 
-  curx = term.c.x;
+  curx = view.c.x;
 
   /* adjust position if in dummy */
-  if (term.line[oldy][oldx].mode & ATTR_WDUMMY)
+  if (view.line[oldy][oldx].mode & ATTR_WDUMMY)
     oldx--;
-  if (term.line[term.c.y][curx].mode & ATTR_WDUMMY)
+  if (view.line[view.c.y][curx].mode & ATTR_WDUMMY)
     curx--;
 
   /* remove the old cursor */
-  og = term.line[oldy][oldx];
-  if (ena_sel && selected(oldx, oldy))
-    og.mode ^= ATTR_REVERSE;
+  og = view.line[oldy][oldx];
   xdrawglyph(og, oldx, oldy);
 
-  g.u = term.line[term.c.y][term.c.x].u;
-  g.mode |= term.line[term.c.y][term.c.x].mode &
+  g.u = view.line[view.c.y][view.c.x].u;
+  g.mode |= view.line[view.c.y][view.c.x].mode &
             (ATTR_BOLD | ATTR_ITALIC | ATTR_UNDERLINE | ATTR_STRUCK);
 
   /*
    * Select the right color for the right mode.
    */
-  if (IS_SET(MODE_REVERSE)) {
+  if (view.mode & MODE_REVERSE) {
     g.mode |= ATTR_REVERSE;
     g.bg = defaultfg;
-    if (ena_sel && selected(term.c.x, term.c.y)) {
+    if (view.cursel) {
       drawcol = dc.col[defaultcs];
       g.fg = defaultrcs;
     } else {
@@ -1223,7 +1709,7 @@ void xdrawcursor(void) {
       g.fg = defaultcs;
     }
   } else {
-    if (ena_sel && selected(term.c.x, term.c.y)) {
+    if (view.cursel) {
       drawcol = dc.col[defaultrcs];
       g.fg = defaultfg;
       g.bg = defaultrcs;
@@ -1232,50 +1718,43 @@ void xdrawcursor(void) {
     }
   }
 
-  if (IS_SET(MODE_HIDE))
+  if (view.mode & MODE_HIDE)
     return;
 
   /* draw the new one */
-  if (win.state & WIN_FOCUSED) {
-    switch (win.cursor) {
+  if (view.state & WIN_FOCUSED) {
+    switch (view.cursor) {
     case 7: /* mt extension: snowman */
       utf8decode("☃", &g.u, UTF_SIZ);
     case 0: /* Blinking Block */
     case 1: /* Blinking Block (Default) */
     case 2: /* Steady Block */
-      g.mode |= term.line[term.c.y][curx].mode & ATTR_WIDE;
-      xdrawglyph(g, term.c.x, term.c.y);
+      g.mode |= view.line[view.c.y][curx].mode & ATTR_WIDE;
+      xdrawglyph(g, view.c.x, view.c.y);
       break;
     case 3: /* Blinking Underline */
     case 4: /* Steady Underline */
       XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                  borderpx + (term.c.y + 1) * win.ch - cursorthickness, win.cw,
+                  borderpx + (view.c.y + 1) * win.ch - cursorthickness, win.cw,
                   cursorthickness);
       break;
     case 5: /* Blinking bar */
     case 6: /* Steady bar */
       XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                  borderpx + term.c.y * win.ch, cursorthickness, win.ch);
+                  borderpx + view.c.y * win.ch, cursorthickness, win.ch);
       break;
     }
   } else {
     XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                borderpx + term.c.y * win.ch, win.cw - 1, 1);
+                borderpx + view.c.y * win.ch, win.cw - 1, 1);
     XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                borderpx + term.c.y * win.ch, 1, win.ch - 1);
+                borderpx + view.c.y * win.ch, 1, win.ch - 1);
     XftDrawRect(xw.draw, &drawcol, borderpx + (curx + 1) * win.cw - 1,
-                borderpx + term.c.y * win.ch, 1, win.ch - 1);
+                borderpx + view.c.y * win.ch, 1, win.ch - 1);
     XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                borderpx + (term.c.y + 1) * win.ch - 1, win.cw, 1);
+                borderpx + (view.c.y + 1) * win.ch - 1, win.cw, 1);
   }
-  oldx = curx, oldy = term.c.y;
-}
-
-void xsetenv(void) {
-  char buf[sizeof(long) * 8 + 1];
-
-  snprintf(buf, sizeof(buf), "%lu", xw.win);
-  setenv("WINDOWID", buf, 1);
+  oldx = curx, oldy = view.c.y;
 }
 
 void xsettitle(const char *p) {
@@ -1289,38 +1768,146 @@ void xsettitle(const char *p) {
   XFree(prop.value);
 }
 
+/*
+ * Publishes the dirty rows and the cursor for the render thread, which draws
+ * them as soon as it is done with the previous frame.
+ */
 void draw(void) {
-  drawregion(0, 0, term.col, term.row);
-  XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w, win.h, 0, 0);
-  XSetForeground(xw.dpy, dc.gc,
-                 dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg].pixel);
+  int x, y, ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+  int full = 0;
+  Line line;
+
+  pthread_mutex_lock(&framelock);
+  if (published.row != term.row || published.col != term.col) {
+    for (y = 0; y < published.row; y++)
+      free(published.line[y]);
+    free(published.line);
+    free(published.dirty);
+    published.row = term.row;
+    published.col = term.col;
+    published.line = xmalloc<Line>(term.row);
+    published.dirty = xmalloc<int>(term.row);
+    for (y = 0; y < term.row; y++)
+      published.line[y] = xmalloc<MTGlyph>(term.col);
+    full = 1;
+  }
+  for (y = 0; y < term.row; y++) {
+    if (!term.dirty[y] && !full)
+      continue;
+    term.dirty[y] = 0;
+    published.dirty[y] = 1;
+    line = published.line[y];
+    memcpy(line, term.line[y], term.col * sizeof(MTGlyph));
+    for (x = 0; ena_sel && x < term.col; x++) {
+      if (line[x].mode != ATTR_WDUMMY && selected(x, y))
+        line[x].mode ^= ATTR_REVERSE;
+    }
+  }
+  published.c = term.c;
+  published.cursel = ena_sel && selected(term.c.x, term.c.y);
+  published.mode = term.mode;
+  published.state = win.state;
+  published.cursor = win.cursor;
+  framepending = 1;
+  pthread_cond_signal(&framecond);
+  pthread_mutex_unlock(&framelock);
+}
+
+/*
+ * Moves the published rows into the view, swapping row buffers so nothing is
+ * copied twice. Called with drawlock held.
+ */
+void xtakeframe(void) {
+  int y;
+
+  pthread_mutex_lock(&framelock);
+  if (view.row != published.row || view.col != published.col) {
+    for (y = 0; y < view.row; y++)
+      free(view.line[y]);
+    free(view.line);
+    free(view.dirty);
+    free(view.specbuf);
+    view.row = published.row;
+    view.col = published.col;
+    view.line = xmalloc<Line>(view.row);
+    view.dirty = xmalloc<int>(view.row);
+    view.specbuf = xmalloc<XftGlyphFontSpec>(view.col);
+    for (y = 0; y < view.row; y++) {
+      view.line[y] = xmalloc<MTGlyph>(view.col);
+      view.dirty[y] = 0;
+    }
+  }
+  for (y = 0; y < view.row; y++) {
+    if (!published.dirty[y])
+      continue;
+    published.dirty[y] = 0;
+    view.dirty[y] = 1;
+    std::swap(view.line[y], published.line[y]);
+  }
+  view.c = published.c;
+  view.cursel = published.cursel;
+  view.mode = published.mode;
+  view.state = published.state;
+  view.cursor = published.cursor;
+  framepending = 0;
+  pthread_mutex_unlock(&framelock);
+}
+
+void *xrenderer(void *unused) {
+  for (;;) {
+    pthread_mutex_lock(&framelock);
+    while (!framepending)
+      pthread_cond_wait(&framecond, &framelock);
+    pthread_mutex_unlock(&framelock);
+
+    xlock();
+    xtakeframe();
+    drawregion(0, 0, view.col, view.row);
+    XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w, win.h, 0, 0);
+    XSetForeground(xw.dpy, dc.gc,
+                   dc.col[(view.mode & MODE_REVERSE) ? defaultfg : defaultbg]
+                       .pixel);
+    XFlush(xw.dpy);
+    xunlock();
+  }
+  return NULL;
 }
 
+void xstartrenderer(void) {
+  pthread_t thread;
+  int err;
+
+  if ((err = pthread_create(&thread, NULL, xrenderer, NULL)))
+    die("pthread_create failed: %s\n", strerror(err));
+  pthread_detach(thread);
+}
+
+void xlock(void) { pthread_mutex_lock(&drawlock); }
+
+void xunlock(void) { pthread_mutex_unlock(&drawlock); }
+
 void drawregion(int x1, int y1, int x2, int y2) {
   int i, x, y, ox, numspecs;
   MTGlyph base, changed;
   XftGlyphFontSpec *specs;
-  int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
 
-  if (!(win.state & WIN_VISIBLE))
+  if (!(view.state & WIN_VISIBLE))
     return;
 
   for (y = y1; y < y2; y++) {
-    if (!term.dirty[y])
+    if (!view.dirty[y])
       continue;
 
-    term.dirty[y] = 0;
+    view.dirty[y] = 0;
 
-    specs = term.specbuf;
-    numspecs = xmakeglyphfontspecs(specs, &term.line[y][x1], x2 - x1, x1, y);
+    specs = view.specbuf;
+    numspecs = xmakeglyphfontspecs(specs, &view.line[y][x1], x2 - x1, x1, y);
 
     i = ox = 0;
     for (x = x1; x < x2 && i < numspecs; x++) {
-      changed = term.line[y][x];
+      changed = view.line[y][x];
       if (changed.mode == ATTR_WDUMMY)
         continue;
-      if (ena_sel && selected(x, y))
-        changed.mode ^= ATTR_REVERSE;
       if (i > 0 && ATTRCMP(base, changed)) {
         xdrawglyphfontspecs(specs, base, i, ox, y);
         specs += i;
@@ -1377,12 +1964,12 @@ void focus(XEvent *ev) {
     win.state |= WIN_FOCUSED;
     xseturgency(0);
     if (IS_SET(MODE_FOCUS))
-      ttywrite("\033[I", 3);
+      ttyreply("\033[I", 3);
   } else {
     XUnsetICFocus(xw.xic);
     win.state &= ~WIN_FOCUSED;
     if (IS_SET(MODE_FOCUS))
-      ttywrite("\033[O", 3);
+      ttyreply("\033[O", 3);
   }
 }
 
@@ -1410,7 +1997,9 @@ void kpress(XEvent *ev) {
 
   /* 2. custom keys from config.h */
   if ((customkey = kmap(ksym, e->state))) {
-    ttysend(customkey, strlen(customkey));
+    xkeysend(customkey, strlen(customkey));
+    clock_gettime(CLOCK_MONOTONIC, &keysent);
+    echopending = 1;
     return;
   }
 
@@ -1429,7 +2018,9 @@ void kpress(XEvent *ev) {
       len = 2;
     }
   }
-  ttysend(buf, len);
+  xkeysend(buf, len);
+  clock_gettime(CLOCK_MONOTONIC, &keysent);
+  echopending = 1;
 }
 
 void cmessage(XEvent *e) {
@@ -1452,6 +2043,19 @@ void cmessage(XEvent *e) {
 }
 
 void resize(XEvent *e) {
+  int x, y;
+
+  /*
+   * The window manager reports moves in root coordinates. Only one that
+   * takes the window's center to another monitor can change its rate.
+   */
+  if (e->xconfigure.send_event) {
+    x = e->xconfigure.x + e->xconfigure.width / 2;
+    y = e->xconfigure.y + e->xconfigure.height / 2;
+    if (!BETWEEN(x, pace.crtc.x, pace.crtc.x + pace.crtc.width - 1) ||
+        !BETWEEN(y, pace.crtc.y, pace.crtc.y + pace.crtc.height - 1))
+      xpaceinit();
+  }
   if (e->xconfigure.width == win.w && e->xconfigure.height == win.h)
     return;
 
@@ -1459,16 +2063,118 @@ void resize(XEvent *e) {
   ttyresize();
 }
 
+#ifdef HAVE_XRANDR
+/*
+ * Returns the refresh rate of the monitor showing the window, 0 if unknown,
+ * and notes the monitor's area in pace.crtc.
+ */
+double xrefreshrate(void) {
+  XRRScreenResources *res;
+  XRRCrtcInfo *crtc;
+  XRRModeInfo *mode;
+  Window child;
+  double rate = 0, vtotal;
+  int x, y, i, j;
+
+  XTranslateCoordinates(xw.dpy, xw.win, RootWindow(xw.dpy, xw.scr), win.w / 2,
+                        win.h / 2, &x, &y, &child);
+  if (!(res = XRRGetScreenResourcesCurrent(xw.dpy, xw.win)))
+    return 0;
+  for (i = 0; i < res->ncrtc && rate == 0; i++) {
+    if (!(crtc = XRRGetCrtcInfo(xw.dpy, res, res->crtcs[i])))
+      continue;
+    if (crtc->mode != None &&
+        BETWEEN(x, crtc->x, crtc->x + (int)crtc->width - 1) &&
+        BETWEEN(y, crtc->y, crtc->y + (int)crtc->height - 1)) {
+      for (j = 0; j < res->nmode; j++) {
+        mode = &res->modes[j];
+        if (mode->id != crtc->mode || !mode->hTotal || !mode->vTotal)
+          continue;
+        vtotal = mode->vTotal;
+        if (mode->modeFlags & RR_DoubleScan)
+          vtotal *= 2;
+        if (mode->modeFlags & RR_Interlace)
+          vtotal /= 2;
+        rate = mode->dotClock / (mode->hTotal * vtotal);
+        pace.crtc.x = crtc->x;
+        pace.crtc.y = crtc->y;
+        pace.crtc.width = crtc->width;
+        pace.crtc.height = crtc->height;
+      }
+    }
+    XRRFreeCrtcInfo(crtc);
+  }
+  XRRFreeScreenResources(res);
+  return rate;
+}
+#endif
+
+/* Reads the refresh period of the window's monitor, xfps without RandR. */
+void xpaceinit(void) {
+  double rate = 0;
+  int64_t period;
+
+  pace.crtc.width = pace.crtc.height = 0;
+#ifdef HAVE_XRANDR
+  rate = xrefreshrate();
+#endif
+  period = 1e9 / (rate > 0 ? rate : MAX(xfps, 1));
+  if (opt_stats && period != pace.period)
+    fprintf(stderr, "mt: refresh: %.2f Hz%s\n", 1e9 / period,
+            rate > 0 ? "" : " (xfps)");
+  pace.period = period;
+}
+
+/* Rereads the refresh rate after RandR reports a mode or layout change. */
+void xscreenchange(XEvent *e) {
+#ifdef HAVE_XRANDR
+  if (xw.rrevent < 0 || e->type != xw.rrevent + RRScreenChangeNotify)
+    return;
+  XRRUpdateConfiguration(e);
+  xpaceinit();
+#endif
+}
+
+/* Returns the time between frames in ns, 0 while nothing can be seen. */
+int64_t xframeinterval(int flood, struct timespec now) {
+  unsigned int fps;
+  int64_t n;
+
+  if (!(win.state & WIN_VISIBLE))
+    return 0;
+  if (!(win.state & WIN_FOCUSED))
+    fps = unfocusedfps;
+  else if (TIMEDIFF(now, pace.input) < interactivetimeout)
+    fps = xfps;
+  else
+    fps = actionfps;
+  /* While flooded, show only the latest state at a steady rate. */
+  if (flood)
+    fps = MIN(fps, floodfps);
+  /* A rate of 0 in config.h means as slow as it gets. */
+  fps = MAX(fps, 1);
+
+  /* Whole refreshes, at most fps of them a second. */
+  n = ceil(1e9 / pace.period / fps - 0.05);
+  return MAX(n, 1) * pace.period;
+}
+
 void run(void) {
-  XEvent ev;
+  XEvent ev, motion;
   int w = win.w, h = win.h;
-  fd_set rfd;
-  int xfd = XConnectionNumber(xw.dpy), xev, blinkset = 0, dodraw = 0;
-  struct timespec drawtimeout, *tv = NULL, now, last, lastblink;
-  long deltatime;
+  int xfd = XConnectionNumber(xw.dpy), xev = 0, blinkset = 0, dirty = 1;
+  int motionset = 0;
+  int ttyfd, ttyready = 0, flood = 0, floodframes = 0;
+  struct timespec now, lastblink, next, floodstart, *deadline;
+  int64_t interval;
+  long budget, hold;
+  size_t n, floodbytes = 0;
 
   /* Waiting for window mapping */
   do {
+    /* Use the wait for the window manager to preload regular glyphs. */
+    while (xwarming() && !XPending(xw.dpy))
+      xwarmup(warmupslice);
     XNextEvent(xw.dpy, &ev);
     /*
      * This XFilterEvent call is required because of XOpenIM. It
@@ -1482,86 +2188,194 @@ void run(void) {
       h = ev.xconfigure.height;
     }
   } while (ev.type != MapNotify);
+  clock_gettime(CLOCK_MONOTONIC, &startup.mapped);
 
+  /* The shell was started with the configured size, now apply the real one. */
   cresize(w, h);
-  ttynew();
   ttyresize();
-
-  clock_gettime(CLOCK_MONOTONIC, &last);
-  lastblink = last;
-
-  for (xev = actionfps;;) {
-    FD_ZERO(&rfd);
-    FD_SET(cmdfd, &rfd);
-    FD_SET(xfd, &rfd);
-
-    if (pselect(MAX(xfd, cmdfd) + 1, &rfd, NULL, NULL, tv, NULL) < 0) {
-      if (errno == EINTR)
+  xpaceinit();
+
+  ttyfd = ttystartreader();
+  evwatch(ttyfd, EV_READ);
+  xstartrenderer();
+  evwatch(xfd, EV_READ);
+
+  clock_gettime(CLOCK_MONOTONIC, &lastblink);
+
+  for (;;) {
+    /* Xlib may have queued events without the socket being readable. */
+    while (XPending(xw.dpy)) {
+      XNextEvent(xw.dpy, &ev);
+      xev = 1;
+      dirty = 1;
+      if (XFilterEvent(&ev, None))
         continue;
-      die("select failed: %s\n", strerror(errno));
-    }
-    if (FD_ISSET(cmdfd, &rfd)) {
-      ttyread();
-      if (blinktimeout) {
-        blinkset = tattrset(ATTR_BLINK);
-        if (!blinkset)
-          MODBIT(term.mode, 0, MODE_BLINK);
+      /*
+       * Motion only matters once per frame, at its latest position. Anything
+       * else sees the pointer where it was before, so it goes first.
+       */
+      if (ev.type == MotionNotify) {
+        motion = ev;
+        motionset = 1;
+        continue;
+      }
+      if (motionset) {
+        handle(&motion);
+        motionset = 0;
       }
+      handle(&ev);
     }
 
-    if (FD_ISSET(xfd, &rfd))
-      xev = actionfps;
-
     clock_gettime(CLOCK_MONOTONIC, &now);
-    drawtimeout.tv_sec = 0;
-    drawtimeout.tv_nsec = (1000 * 1E6) / xfps;
-    tv = &drawtimeout;
-
-    dodraw = 0;
-    if (blinktimeout && TIMEDIFF(now, lastblink) > blinktimeout) {
+    if (xev) {
+      pace.input = now;
+      xev = 0;
+    }
+    if (blinkset && TIMEDIFF(now, lastblink) >= blinktimeout) {
       tsetdirtattr(ATTR_BLINK);
       term.mode ^= MODE_BLINK;
       lastblink = now;
-      dodraw = 1;
+      dirty = 1;
     }
-    deltatime = TIMEDIFF(now, last);
-    if (deltatime > 1000 / (xev ? xfps : actionfps)) {
-      dodraw = 1;
-      last = now;
+
+    interval = xframeinterval(flood, now);
+    /* Don't show half of a program's synchronized update. */
+    hold = tsynchold();
+    if (dirty && interval && !hold && TSNS(now) >= pace.next) {
+      if (motionset) {
+        handle(&motion);
+        motionset = 0;
+      }
+      draw();
+      dirty = 0;
+      warmfaces = 1;
+      floodframes += flood;
+      /* Stay on the grid, unless the last frame is long past. */
+      pace.next += interval;
+      if (pace.next <= TSNS(now))
+        pace.next = TSNS(now) + interval;
+      if (startup.output.tv_sec && !startup.frame.tv_sec) {
+        clock_gettime(CLOCK_MONOTONIC, &startup.frame);
+        if (opt_stats)
+          startupreport();
+      }
     }
 
-    if (dodraw) {
-      while (XPending(xw.dpy)) {
-        XNextEvent(xw.dpy, &ev);
-        if (XFilterEvent(&ev, None))
-          continue;
-        handle(&ev);
+    /*
+     * Sleep until the next frame or blink is due. Don't block at all while
+     * there is output left to parse or glyphs left to warm up.
+     */
+    deadline = NULL;
+    if (ttyready || xwarming()) {
+      next = now;
+      deadline = &next;
+    } else {
+      if (dirty && interval) {
+        next.tv_sec = pace.next / 1000000000;
+        next.tv_nsec = pace.next % 1000000000;
+        if (hold && TIMEDIFF(next, now) < hold)
+          next = tsadd(now, hold);
+        deadline = &next;
+      }
+      /* A blink can't be seen either while the window can't. */
+      if (blinkset && interval) {
+        struct timespec blink = tsadd(lastblink, blinktimeout);
+        if (!deadline || TIMEDIFF(blink, next) < 0)
+          next = blink;
+        deadline = &next;
+      }
+      /* Wake up to give up on an INCR paste whose owner went quiet. */
+      if (paste.incr && paste.held == None) {
+        struct timespec stall = tsadd(paste.last, pasteincrtimeout);
+        if (!deadline || TIMEDIFF(stall, next) < 0)
+          next = stall;
+        deadline = &next;
+      }
+    }
+    /*
+     * Replies queued during the last batch go out here in one write, input
+     * the pty didn't take once it's writable again.
+     */
+    xpastefeed();
+    evwatch(cmdfd, ttyflush() ? EV_WRITE : 0);
+    evwait(deadline);
+
+    if (evchild())
+      ttyreap(0);
+    if (evready(ttyfd) & EV_READ)
+      ttyready = 1;
+    if (ttyready) {
+      /*
+       * Parse in slices so X events and frames keep flowing. Once output
+       * outpaces a slice, parse right up to the next frame instead.
+       */
+      budget = parseslice;
+      if (flood) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        budget = MAX(budget, (long)((pace.next - TSNS(now)) / 1000000));
+      }
+      if ((n = ttyread(budget)) > 0) {
+        dirty = 1;
+        if (!startup.output.tv_sec)
+          clock_gettime(CLOCK_MONOTONIC, &startup.output);
+      } else {
+        ttyready = 0;
       }
 
-      draw();
-      XFlush(xw.dpy);
-
-      if (xev && !FD_ISSET(xfd, &rfd))
-        xev--;
-      if (!FD_ISSET(cmdfd, &rfd) && !FD_ISSET(xfd, &rfd)) {
-        if (blinkset) {
-          if (TIMEDIFF(now, lastblink) > blinktimeout) {
-            drawtimeout.tv_nsec = 1000;
-          } else {
-            drawtimeout.tv_nsec =
-                (1E6 * (blinktimeout - TIMEDIFF(now, lastblink)));
-          }
-          drawtimeout.tv_sec = drawtimeout.tv_nsec / 1E9;
-          drawtimeout.tv_nsec %= (long)1E9;
-        } else {
-          tv = NULL;
+      if (!flood && n > 0 && ttypending()) {
+        flood = 1;
+        floodbytes = floodframes = 0;
+        clock_gettime(CLOCK_MONOTONIC, &floodstart);
+      } else if (flood && !ttypending()) {
+        flood = 0;
+        if (opt_stats) {
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          fprintf(stderr, "mt: flood: %zu bytes in %ld ms, %d frames\n",
+                  floodbytes + n, (long)TIMEDIFF(now, floodstart),
+                  floodframes);
+          ttyreport();
+        }
+      }
+      floodbytes += n;
+
+      /*
+       * Typing: the first complete output after a key is most likely its
+       * echo, draw it now rather than at the next frame.
+       */
+      if (echopending && n > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (TIMEDIFF(now, keysent) >= echowindow) {
+          echopending = 0;
+        } else if (!flood && !ttypending() && !tsynchold()) {
+          draw();
+          dirty = 0;
+          echopending = 0;
         }
       }
+      if (blinktimeout) {
+        blinkset = tattrset(ATTR_BLINK);
+        if (!blinkset)
+          MODBIT(term.mode, 0, MODE_BLINK);
+      }
+    } else if (xwarming() && !evready(xfd)) {
+      xwarmup(warmupslice);
     }
   }
 }
 
+void startupreport(void) {
+  fprintf(stderr,
+          "mt: startup: tty %ld ms, xinit %ld ms, mapped %ld ms, "
+          "first output %ld ms, first frame %ld ms\n",
+          (long)TIMEDIFF(startup.tty, startup.start),
+          (long)TIMEDIFF(startup.xinit, startup.start),
+          (long)TIMEDIFF(startup.mapped, startup.start),
+          (long)TIMEDIFF(startup.output, startup.start),
+          (long)TIMEDIFF(startup.frame, startup.start));
+}
+
 int main(int argc, char *argv[]) {
+  clock_gettime(CLOCK_MONOTONIC, &startup.start);
   xw.l = xw.t = 0;
   xw.isfixed = False;
   win.cursor = cursorshape;
@@ -1586,9 +2400,15 @@ int main(int argc, char *argv[]) {
   case 'i':
     xw.isfixed = 1;
     break;
+  case 'L':
+    opt_log = EARGF(usage());
+    break;
   case 'o':
     opt_io = EARGF(usage());
     break;
+  case 'S':
+    opt_stats = 1;
+    break;
   case 'n':
     opt_name = EARGF(usage());
     break;
@@ -1617,7 +2437,20 @@ run:
   setlocale(LC_CTYPE, "");
   XSetLocaleModifiers("");
   tnew(MAX(cols, 1), MAX(rows, 1));
+  /*
+   * The shell starts with the configured geometry while fonts load; run()
+   * applies the real size once the window is mapped. Until then its output
+   * waits in the pty.
+   *
+   * SIGCHLD is blocked by evinit() before the fork, so a shell that exits
+   * right away is still seen, and every thread inherits the mask.
+   */
+  evinit();
+  xopen();
+  ttynew();
+  clock_gettime(CLOCK_MONOTONIC, &startup.tty);
   xinit();
+  clock_gettime(CLOCK_MONOTONIC, &startup.xinit);
   selinit();
   run();
 
@@ -19,10 +19,12 @@ void xclipcopy(void);
 void xclippaste(void);
 void xhints(void);
 void xinit(void);
+void xopen(void);
 void xloadcols(void);
+void xlock(void);
+void xunlock(void);
 int xsetcolorname(int, const char *);
 void xloadfonts(const char *, double);
-void xsetenv(void);
 void xsettitle(const char *);
 void xsetpointermotion(int);
 void xseturgency(int);